@@ -0,0 +1,431 @@
+#include "server.h"
+#include "actor.h"
+#include <sys/eventfd.h>
+
+#define ACTOR_DRAIN_BATCH 64     // room requests handled before yielding the room
+#define REBALANCE_MS 1000        // load accounting window
+#define ACTOR_HOT_LOAD 1000      // work units per window before an actor counts as hot
+
+enum room_op { ROOM_JOIN, ROOM_LEAVE, ROOM_MSG, ROOM_RELAY, ROOM_CHARGE };
+
+// one request in a room's inbox
+struct room_msg {
+    struct mpsc_node link;
+    enum room_op op;
+    struct node *user;           // join / leave
+    struct conn *from;           // msg: sender, holds a reference
+    struct chat_msg *msg;        // msg: holds a reference
+    struct relay *relay;         // relay: filled in by the owner; charge: flagged if busy
+    struct actor_sync *sync;
+};
+
+// a thread that owns a set of rooms; rooms with pending requests are queued
+// on its mailbox, and it alone touches their member lists
+struct actor {
+    struct mpsc_queue mailbox;
+    int wake_fd;
+    atomic_int sleeping;
+    atomic_long epoch;           // window the load counters belong to
+    atomic_ulong cur_load;
+    atomic_ulong last_load;      // load over the previous window
+    long migrated_epoch;         // last window this actor gave a room away
+};
+
+static struct actor *actors = NULL;
+static int num_actors = 0;
+static atomic_uint next_owner = 0;
+
+static long now_epoch(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / REBALANCE_MS;
+}
+
+// load over the last complete window
+static unsigned long actor_load(struct actor *a, long epoch) {
+    long e = atomic_load(&a->epoch);
+    if (e == epoch) return atomic_load(&a->last_load);
+    if (e == epoch - 1) return atomic_load(&a->cur_load);
+    return 0;
+}
+
+static void actor_account(struct actor *a, unsigned long units, long epoch) {
+    long e = atomic_load(&a->epoch);
+    if (e != epoch) {
+        atomic_store(&a->last_load, e == epoch - 1 ? atomic_load(&a->cur_load) : 0);
+        atomic_store(&a->cur_load, 0);
+        atomic_store(&a->epoch, epoch);
+    }
+    atomic_fetch_add(&a->cur_load, units);
+}
+
+// owner of a room, assigned round-robin on first use
+static int room_owner(struct room *r) {
+    int owner = atomic_load(&r->owner);
+    if (owner < 0) {
+        int pick = (int)(atomic_fetch_add(&next_owner, 1) % num_actors);
+        if (atomic_compare_exchange_strong(&r->owner, &owner, pick)) {
+            owner = pick;
+        }
+    }
+    return owner;
+}
+
+// put a room on its owner's mailbox unless it is already queued or running
+static void schedule_room(struct room *r) {
+    if (atomic_exchange(&r->scheduled, 1) != 0) {
+        return;
+    }
+    struct actor *a = &actors[room_owner(r)];
+    mpsc_push(&a->mailbox, &r->sched);
+    if (atomic_exchange(&a->sleeping, 0) == 1) {
+        uint64_t one = 1;
+        if (write(a->wake_fd, &one, sizeof(one)) == -1) {
+            perror("eventfd write");
+        }
+    }
+}
+
+static void post(struct room *r, struct room_msg *m) {
+    if (m->sync) {
+        pthread_mutex_lock(&m->sync->lock);
+        m->sync->remaining++;
+        pthread_mutex_unlock(&m->sync->lock);
+    }
+    mpsc_push(&r->inbox, &m->link);
+    schedule_room(r);
+}
+
+static void sync_done(struct actor_sync *sync) {
+    if (!sync) return;
+    pthread_mutex_lock(&sync->lock);
+    if (--sync->remaining == 0) {
+        pthread_cond_broadcast(&sync->cond);
+    }
+    pthread_mutex_unlock(&sync->lock);
+}
+
+// charge a fan-out to the room's budget, telling the sender if it is busy
+// (from may be NULL to stay quiet)
+// the owner is the only one touching the bucket, so no fanout_lock here
+static int room_charge(struct room *r, struct conn *from, unsigned long members) {
+    if (config.room_fanout_rate > 0 && members > 1) {
+        if (r->fanout.burst == 0) {
+            tb_init(&r->fanout, config.room_fanout_rate, 2 * config.room_fanout_rate);
+        }
+        if (!tb_take(&r->fanout, members - 1)) {
+            if (!from) {
+                return 0;
+            }
+            char text[SMALLBUFF], notice[SMALLBUFF + BIN_HEADER + 6];
+            snprintf(text, sizeof(text), "Room %s is busy, message not delivered. Slow down.", r->name);
+            size_t len = encode_reply(notice, sizeof(notice), atomic_load(&from->binary),
+                                      0, OP_MSG, r->id, text);
+            conn_queue(from, notice, len);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// fan a message out to every member but the sender, return sends made
+static unsigned long room_deliver(struct room *r, struct room_msg *m) {
+    struct room_user *ru;
+    unsigned long sent = 0;
+
+    if (!room_charge(r, m->from, r->member_count)) {
+        return 0;
+    }
+
+    TRACE_BEGIN(TP_FANOUT);
+    for (ru = r->users; ru != NULL; ru = ru->next) {
+        struct conn *c = ru->user->conn;
+        // a member sharing several rooms or a DM with the sender gets it once
+        if (c && c != m->from && chat_msg_claim(m->msg, ru->user->id)) {
+            chat_msg_send(c, m->msg);
+            sent++;
+        }
+    }
+    TRACE_END(TP_FANOUT);
+    return sent;
+}
+
+// add every member but the sender to a relay, return members added
+static unsigned long room_relay(struct room *r, struct room_msg *m) {
+    struct room_user *ru;
+    unsigned long added = 0;
+
+    if (!room_charge(r, m->from, r->member_count)) {
+        return 0;
+    }
+
+    for (ru = r->users; ru != NULL; ru = ru->next) {
+        struct conn *c = ru->user->conn;
+        if (c && c != m->from) {
+            relay_add(m->relay, c);
+            added++;
+        }
+    }
+    return added;
+}
+
+// move a room off a hot actor onto the coolest one; the room is not
+// scheduled anywhere else while its owner drains it, so changing the owner
+// here keeps its inbox single-consumer and in order. return 1 if it moved
+static int maybe_migrate(struct actor *self, int self_idx, struct room *r, long epoch) {
+    int i, coolest = -1;
+    unsigned long my_load = actor_load(self, epoch);
+    unsigned long min_load = 0;
+
+    if (num_actors < 2 || my_load < ACTOR_HOT_LOAD || self->migrated_epoch == epoch) {
+        return 0;
+    }
+    for (i = 0; i < num_actors; i++) {
+        unsigned long l = actor_load(&actors[i], epoch);
+        if (i != self_idx && (coolest < 0 || l < min_load)) {
+            coolest = i;
+            min_load = l;
+        }
+    }
+    // only move the room if the move leaves the two actors closer together
+    unsigned long room_load = r->last_load > r->load ? r->last_load : r->load;
+    if (coolest < 0 || min_load + room_load >= my_load) {
+        return 0;
+    }
+
+    printf("room %s moves from actor %d to actor %d\n", r->name, self_idx, coolest);
+    atomic_store(&r->owner, coolest);
+    self->migrated_epoch = epoch;
+    return 1;
+}
+
+// delete the room if it is empty and nothing is queued for it; posts are
+// made under the global lock, so none can arrive while the write lock is
+// held. return 1 if the room is gone
+static int maybe_delete(struct room *r) {
+    if (r->member_count > 0 || !mpsc_empty(&r->inbox) || strcmp(r->name, DEFAULT_ROOM) == 0) {
+        return 0;
+    }
+    start_write();
+    int gone = mpsc_empty(&r->inbox);
+    if (gone) {
+        deleteRoom(r);
+    }
+    end_write();
+    return gone;
+}
+
+static void run_room(struct actor *self, int self_idx, struct room *r) {
+    long epoch = now_epoch();
+    unsigned long units = 0;
+    int n;
+
+    if (r->load_epoch != epoch) {
+        r->last_load = r->load_epoch == epoch - 1 ? r->load : 0;
+        r->load = 0;
+        r->load_epoch = epoch;
+    }
+
+    for (n = 0; n < ACTOR_DRAIN_BATCH; n++) {
+        struct mpsc_node *node = mpsc_pop(&r->inbox);
+        if (!node) break;
+        struct room_msg *m = container_of(node, struct room_msg, link);
+
+        switch (m->op) {
+        case ROOM_JOIN:
+            addUserToRoom(r, m->user);
+            units++;
+            break;
+        case ROOM_LEAVE:
+            removeUserFromRoom(r, m->user);
+            units++;
+            break;
+        case ROOM_MSG:
+            units += 1 + room_deliver(r, m);
+            conn_put(m->from);
+            chat_msg_put(m->msg);
+            break;
+        case ROOM_RELAY:
+            units += 1 + room_relay(r, m);
+            conn_put(m->from);
+            break;
+        case ROOM_CHARGE:
+            // the sender's thread tells it the message was cut
+            if (!room_charge(r, NULL, r->member_count)) {
+                atomic_store(&m->relay->busy, 1);
+            }
+            units++;
+            conn_put(m->from);
+            break;
+        }
+        sync_done(m->sync);
+        free(m);
+    }
+
+    r->load += units;
+    actor_account(self, units, epoch);
+    if (maybe_delete(r)) {
+        return;
+    }
+    int moved = maybe_migrate(self, self_idx, r, epoch);
+
+    // release the room, then pick it up again if requests arrived meanwhile.
+    // once it has moved, its new owner may run and delete it as soon as it
+    // is released, which the read lock holds off until we are done with it
+    if (moved) {
+        start_read();
+    }
+    atomic_store(&r->scheduled, 0);
+    if (!mpsc_empty(&r->inbox)) {
+        schedule_room(r);
+    }
+    if (moved) {
+        end_read();
+    }
+}
+
+static void *actor_main(void *arg) {
+    int idx = (int)(long) arg;
+    struct actor *self = &actors[idx];
+
+    TRACE_THREAD("actor", idx);
+    place_thread(PLACE_ACTOR, idx);
+    while (1) {
+        struct mpsc_node *n = mpsc_pop(&self->mailbox);
+        if (n) {
+            run_room(self, idx, container_of(n, struct room, sched));
+            continue;
+        }
+
+        // announce we are going to sleep, then look once more before blocking
+        atomic_store(&self->sleeping, 1);
+        n = mpsc_pop(&self->mailbox);
+        if (n) {
+            atomic_store(&self->sleeping, 0);
+            run_room(self, idx, container_of(n, struct room, sched));
+            continue;
+        }
+        uint64_t count;
+        if (read(self->wake_fd, &count, sizeof(count)) == -1 && errno != EINTR) {
+            perror("eventfd read");
+        }
+    }
+    return NULL;
+}
+
+int actors_start(int n) {
+    int i;
+
+    if (n <= 0) {
+        return 0;
+    }
+
+    actors = (struct actor *) calloc(n, sizeof(struct actor));
+    if (!actors) {
+        perror("calloc");
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        mpsc_init(&actors[i].mailbox);
+        actors[i].wake_fd = eventfd(0, EFD_CLOEXEC);
+        if (actors[i].wake_fd == -1) {
+            perror("eventfd");
+            return -1;
+        }
+        actors[i].migrated_epoch = -1;
+    }
+
+    num_actors = n;
+    for (i = 0; i < n; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, actor_main, (void *)(long) i) != 0) {
+            perror("pthread_create");
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+    return 0;
+}
+
+int actors_running(void) {
+    return num_actors > 0;
+}
+
+static struct room_msg *new_msg(enum room_op op) {
+    struct room_msg *m = (struct room_msg *) malloc(sizeof(struct room_msg));
+    if (!m) {
+        perror("malloc");
+        return NULL;
+    }
+    m->op = op;
+    m->user = NULL;
+    m->from = NULL;
+    m->msg = NULL;
+    m->relay = NULL;
+    m->sync = NULL;
+    return m;
+}
+
+void actor_post_join(struct room *r, struct node *user, struct actor_sync *sync) {
+    struct room_msg *m = new_msg(ROOM_JOIN);
+    if (!m) return;
+    m->user = user;
+    m->sync = sync;
+    post(r, m);
+}
+
+void actor_post_leave(struct room *r, struct node *user, struct actor_sync *sync) {
+    struct room_msg *m = new_msg(ROOM_LEAVE);
+    if (!m) return;
+    m->user = user;
+    m->sync = sync;
+    post(r, m);
+}
+
+void actor_post_msg(struct room *r, struct conn *from, struct chat_msg *msg) {
+    struct room_msg *m = new_msg(ROOM_MSG);
+    if (!m) return;
+    conn_get(from);
+    chat_msg_get(msg);
+    m->from = from;
+    m->msg = msg;
+    post(r, m);
+}
+
+void actor_post_relay(struct room *r, struct conn *from, struct relay *relay,
+                      struct actor_sync *sync) {
+    struct room_msg *m = new_msg(ROOM_RELAY);
+    if (!m) return;
+    conn_get(from);
+    m->from = from;
+    m->relay = relay;
+    m->sync = sync;
+    post(r, m);
+}
+
+void actor_post_charge(struct room *r, struct conn *from, struct relay *relay,
+                       struct actor_sync *sync) {
+    struct room_msg *m = new_msg(ROOM_CHARGE);
+    if (!m) return;
+    conn_get(from);
+    m->from = from;
+    m->relay = relay;
+    m->sync = sync;
+    post(r, m);
+}
+
+void actor_sync_init(struct actor_sync *sync) {
+    pthread_mutex_init(&sync->lock, NULL);
+    pthread_cond_init(&sync->cond, NULL);
+    sync->remaining = 0;
+}
+
+void actor_sync_wait(struct actor_sync *sync) {
+    pthread_mutex_lock(&sync->lock);
+    while (sync->remaining > 0) {
+        pthread_cond_wait(&sync->cond, &sync->lock);
+    }
+    pthread_mutex_unlock(&sync->lock);
+    pthread_mutex_destroy(&sync->lock);
+    pthread_cond_destroy(&sync->cond);
+}
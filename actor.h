@@ -0,0 +1,52 @@
+#ifndef ACTOR_H
+#define ACTOR_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+struct room;
+struct node;
+struct conn;
+struct chat_msg;
+struct relay;
+
+// lets a client thread wait until the actors have applied its requests
+struct actor_sync {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int remaining;
+};
+
+// start n room actor threads; 0 leaves actor mode off
+// return 0 on success, -1 on failure
+int actors_start(int n);
+
+// return 1 if rooms are owned by actors
+int actors_running(void);
+
+// every post is made with the global lock held, read or write: the owner
+// deletes an empty room under the write lock once its inbox is drained
+
+// post a membership change to the room's owner; sync may be NULL
+void actor_post_join(struct room *r, struct node *user, struct actor_sync *sync);
+void actor_post_leave(struct room *r, struct node *user, struct actor_sync *sync);
+
+// post a chat message to be fanned out by the room's owner
+// msg is shared, not copied; replies to the sender go through its output queue
+void actor_post_msg(struct room *r, struct conn *from, struct chat_msg *msg);
+
+// ask the room's owner to add the room's members but the sender to a relay
+void actor_post_relay(struct room *r, struct conn *from, struct relay *relay,
+                      struct actor_sync *sync);
+
+// charge one more piece of a relay to the room's fan-out budget, setting
+// relay->busy if the room is over it
+void actor_post_charge(struct room *r, struct conn *from, struct relay *relay,
+                       struct actor_sync *sync);
+
+void actor_sync_init(struct actor_sync *sync);
+
+// block until every request posted with this sync has been processed
+void actor_sync_wait(struct actor_sync *sync);
+
+#endif
@@ -0,0 +1,50 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "bufpool.h"
+
+void *pool_get(struct buf_pool *pool) {
+    void *block = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->free_list != NULL) {
+        block = pool->free_list;
+        pool->free_list = *(void **)block;
+        pool->nfree--;
+    }
+    pool->in_use++;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (block == NULL) {
+        block = malloc(pool->size);
+        if (!block) {
+            perror("malloc");
+            pthread_mutex_lock(&pool->lock);
+            pool->in_use--;
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+    return block;
+}
+
+void pool_put(struct buf_pool *pool, void *block) {
+    if (!block) return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->in_use--;
+    if (pool->nfree < pool->max_free) {
+        *(void **)block = pool->free_list;
+        pool->free_list = block;
+        pool->nfree++;
+        block = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    free(block);   // pool is full, give it back
+}
+
+int pool_in_use(struct buf_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    int n = pool->in_use;
+    pthread_mutex_unlock(&pool->lock);
+    return n;
+}
@@ -0,0 +1,29 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+// shared pool of fixed-size blocks with a bounded free list
+struct buf_pool {
+    pthread_mutex_t lock;
+    size_t size;                 // block size in bytes
+    void *free_list;             // cached free blocks, linked through their first word
+    int nfree;
+    int max_free;                // blocks beyond this go back to malloc
+    int in_use;
+};
+
+#define BUF_POOL_INIT(sz, maxfree) \
+    { PTHREAD_MUTEX_INITIALIZER, (sz), NULL, 0, (maxfree), 0 }
+
+// get a block, or NULL if out of memory
+void *pool_get(struct buf_pool *pool);
+
+// return a block to the pool
+void pool_put(struct buf_pool *pool, void *block);
+
+// blocks handed out and not yet returned
+int pool_in_use(struct buf_pool *pool);
+
+#endif
@@ -0,0 +1,392 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include "conn.h"
+
+#define CONN_IOV 64              // chunks handed to the kernel per sendmsg()
+#define CONN_QUEUE_MAX (4 << 20) // queued bytes before a client counts as stuck
+
+// egress coalescing, set once at startup
+static long coalesce_ns = 0;
+static size_t coalesce_bytes = 0;
+
+// smallest shared chunk sent with MSG_ZEROCOPY, 0 when off
+static size_t zerocopy_min = 0;
+
+void conn_coalesce(long window_us, size_t max_bytes) {
+    coalesce_ns = window_us * 1000;
+    coalesce_bytes = max_bytes;
+}
+
+void conn_zerocopy(size_t min_bytes) {
+    zerocopy_min = min_bytes;
+}
+
+// post a wakeup to the owner
+static void conn_wake(struct conn *c) {
+    uint64_t one = 1;
+    if (write(c->wake_fd, &one, sizeof(one)) == -1) {
+        perror("eventfd write");
+    }
+}
+
+// free a chunk, letting go of shared data
+static void chunk_free(struct out_chunk *chunk) {
+    if (chunk->release) {
+        chunk->release(chunk->arg);
+    }
+    free(chunk);
+}
+
+struct conn *conn_new(int fd) {
+    struct conn *c = (struct conn *) malloc(sizeof(struct conn));
+    if (!c) {
+        perror("malloc");
+        return NULL;
+    }
+
+    c->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (c->wake_fd == -1) {
+        perror("eventfd");
+        free(c);
+        return NULL;
+    }
+
+    c->fd = fd;
+    atomic_init(&c->refs, 1);
+    atomic_init(&c->wake_pending, 0);
+    atomic_init(&c->dead, 0);
+    atomic_init(&c->binary, 0);
+    atomic_init(&c->jobs, 0);
+    c->user_id = 0;
+    c->inbuf = NULL;
+    c->inlen = 0;
+    c->relay = NULL;
+    atomic_init(&c->queued, 0);
+    c->flush_armed = 0;
+    c->parked = 0;
+    mpsc_init(&c->outq);
+
+    c->zc_on = 0;
+    c->zc_id = 0;
+    c->zc_head = c->zc_tail = NULL;
+    if (zerocopy_min > 0) {
+        int one = 1;
+        c->zc_on = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+    }
+    return c;
+}
+
+void conn_get(struct conn *c) {
+    atomic_fetch_add_explicit(&c->refs, 1, memory_order_relaxed);
+}
+
+void conn_put(struct conn *c) {
+    if (atomic_fetch_sub_explicit(&c->refs, 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+
+    struct mpsc_node *n;
+    while ((n = mpsc_pop(&c->outq)) != NULL) {
+        chunk_free(container_of(n, struct out_chunk, link));
+    }
+
+    // the kernel may still be reading zero-copy chunks: reset the connection
+    // so it drops them, rather than sending memory that is about to be reused
+    if (c->zc_head != NULL) {
+        struct linger lg = { .l_onoff = 1, .l_linger = 0 };
+        setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    }
+    close(c->fd);
+    while (c->zc_head != NULL) {
+        struct out_chunk *chunk = c->zc_head;
+        c->zc_head = chunk->zc_next;
+        chunk_free(chunk);
+    }
+    free(c->inbuf);
+    close(c->wake_fd);
+    free(c);
+}
+
+void conn_kill(struct conn *c) {
+    if (atomic_exchange(&c->dead, 1) == 0) {
+        shutdown(c->fd, SHUT_RDWR);
+    }
+}
+
+// put a chunk on the queue and wake the owner if needed
+static int push_chunk(struct conn *c, struct out_chunk *chunk) {
+    size_t len = chunk->len;
+
+    if (atomic_load(&c->dead)) {
+        chunk_free(chunk);
+        return -1;
+    }
+    if (atomic_load(&c->queued) + len > CONN_QUEUE_MAX) {
+        // the client has stopped reading; drop it rather than its output
+        conn_kill(c);
+        chunk_free(chunk);
+        return -1;
+    }
+
+    mpsc_push(&c->outq, &chunk->link);
+    size_t before = atomic_fetch_add(&c->queued, len);
+
+    // only the first producer since the owner last drained pays for a wakeup,
+    // plus the one that takes held-back output over the byte threshold; none
+    // is needed while the owner has claimed the next flush
+    int state = 0;
+    if (atomic_compare_exchange_strong(&c->wake_pending, &state, 1)) {
+        conn_wake(c);
+    } else if (state == 1 && coalesce_ns > 0 && before < coalesce_bytes &&
+               before + len >= coalesce_bytes) {
+        conn_wake(c);
+    }
+    return 0;
+}
+
+int conn_queue(struct conn *c, const char *data, size_t len) {
+    struct out_chunk *chunk = (struct out_chunk *) malloc(sizeof(struct out_chunk) + len);
+    if (!chunk) {
+        perror("malloc");
+        return -1;
+    }
+    chunk->len = len;
+    chunk->data = chunk->buf;
+    chunk->release = NULL;
+    chunk->zerocopy = 0;
+    memcpy(chunk->buf, data, len);
+    return push_chunk(c, chunk);
+}
+
+int conn_queue_ref(struct conn *c, const char *data, size_t len,
+                   void (*release)(void *), void *arg) {
+    struct out_chunk *chunk = (struct out_chunk *) malloc(sizeof(struct out_chunk));
+    if (!chunk) {
+        perror("malloc");
+        release(arg);
+        return -1;
+    }
+    chunk->len = len;
+    chunk->data = data;
+    chunk->release = release;
+    chunk->arg = arg;
+    chunk->zerocopy = c->zc_on && len >= zerocopy_min;
+    return push_chunk(c, chunk);
+}
+
+void conn_send(struct conn *c, const char *data, size_t len) {
+    conn_queue(c, data, len);
+}
+
+void conn_claim_flush(struct conn *c) {
+    int idle = 0;
+    atomic_compare_exchange_strong(&c->wake_pending, &idle, 2);
+}
+
+int conn_held(struct conn *c, struct timespec *left) {
+    if (!c->flush_armed) {
+        return 0;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long ns = (c->flush_at.tv_sec - now.tv_sec) * 1000000000L + (c->flush_at.tv_nsec - now.tv_nsec);
+    if (ns < 0) ns = 0;
+    left->tv_sec = ns / 1000000000L;
+    left->tv_nsec = ns % 1000000000L;
+    return 1;
+}
+
+// hold output back until the window ends or the byte threshold is reached
+// return 1 while it should wait
+static int conn_hold(struct conn *c) {
+    struct timespec now;
+
+    if (atomic_load(&c->queued) >= coalesce_bytes) {
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!c->flush_armed) {
+        long ns = now.tv_nsec + coalesce_ns;
+        c->flush_at.tv_sec = now.tv_sec + ns / 1000000000L;
+        c->flush_at.tv_nsec = ns % 1000000000L;
+        c->flush_armed = 1;
+        return 1;
+    }
+    return now.tv_sec < c->flush_at.tv_sec ||
+           (now.tv_sec == c->flush_at.tv_sec && now.tv_nsec < c->flush_at.tv_nsec);
+}
+
+// keep a chunk sent zero-copy until the kernel reports the send done
+static void zc_hold(struct conn *c, struct out_chunk *chunk) {
+    chunk->zc_next = NULL;
+    if (c->zc_tail != NULL) {
+        c->zc_tail->zc_next = chunk;
+    } else {
+        c->zc_head = chunk;
+    }
+    c->zc_tail = chunk;
+}
+
+int conn_reap(struct conn *c) {
+    char control[128];
+    int reaped = 0;
+
+    while (1) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(c->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+            break;
+        }
+
+        struct cmsghdr *cm;
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            struct sock_extended_err *ee = (struct sock_extended_err *) CMSG_DATA(cm);
+            if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+
+            // sends ee_info .. ee_data are done; TCP finishes them in order,
+            // so everything up to ee_data can go
+            while (c->zc_head != NULL && (int32_t) (ee->ee_data - c->zc_head->zc_id) >= 0) {
+                struct out_chunk *chunk = c->zc_head;
+                c->zc_head = chunk->zc_next;
+                chunk_free(chunk);
+            }
+            if (c->zc_head == NULL) {
+                c->zc_tail = NULL;
+            }
+            reaped++;
+        }
+    }
+    return reaped;
+}
+
+void conn_settle(struct conn *c, int timeout_ms) {
+    struct timespec now, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    end.tv_sec += timeout_ms / 1000;
+    end.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (end.tv_nsec >= 1000000000L) {
+        end.tv_sec++;
+        end.tv_nsec -= 1000000000L;
+    }
+
+    // POLLERR needs no asking for, and says completions have come
+    while (c->zc_head != NULL) {
+        struct pollfd pfd = { .fd = c->fd, .events = 0 };
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long ms = (end.tv_sec - now.tv_sec) * 1000 + (end.tv_nsec - now.tv_nsec) / 1000000;
+        if (ms <= 0 || poll(&pfd, 1, (int) ms) == 0) {
+            break;
+        }
+        if (conn_reap(c) == 0 && (pfd.revents & (POLLHUP | POLLNVAL))) {
+            break;
+        }
+    }
+}
+
+void conn_flush(struct conn *c, int force) {
+    // 1 means a producer posted a wakeup, 2 that the owner claimed this flush
+    uint64_t count;
+    if (atomic_exchange(&c->wake_pending, 0) == 1 &&
+        read(c->wake_fd, &count, sizeof(count)) == -1) {
+        // the wakeup is still on its way, drain anyway
+    }
+
+    // let go of zero-copy chunks the kernel has finished with
+    if (c->zc_head != NULL) {
+        conn_reap(c);
+    }
+
+    if (coalesce_ns > 0 && !force && conn_hold(c)) {
+        return;
+    }
+    c->flush_armed = 0;
+
+    // gather up to CONN_IOV chunks per call; MSG_MORE tells TCP another
+    // batch follows, so only the last one pushes a partial segment out.
+    // A zero-copy chunk goes in a call of its own, so each completion the
+    // kernel numbers belongs to one chunk
+    struct out_chunk *batch[CONN_IOV];
+    struct iovec iov[CONN_IOV];
+    struct mpsc_node *n = mpsc_pop(&c->outq);
+    while (n != NULL) {
+        int k = 0;
+        size_t bytes = 0;
+        int zc = container_of(n, struct out_chunk, link)->zerocopy;
+        int zc_sent = 0;
+        while (n != NULL && k < CONN_IOV) {
+            struct out_chunk *chunk = container_of(n, struct out_chunk, link);
+            if (k > 0 && (zc || chunk->zerocopy)) {
+                break;
+            }
+            batch[k] = chunk;
+            iov[k].iov_base = (void *) chunk->data;
+            iov[k].iov_len = chunk->len;
+            bytes += chunk->len;
+            k++;
+            n = mpsc_pop(&c->outq);
+        }
+
+        // the socket blocks, so a short write means a signal came in; send
+        // the rest of the batch before anything queued behind it
+        struct iovec *v = iov;
+        int left = k;
+        while (left > 0 && !atomic_load(&c->dead)) {
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = v;
+            msg.msg_iovlen = left;
+            ssize_t sent = sendmsg(c->fd, &msg, MSG_NOSIGNAL | (n != NULL ? MSG_MORE : 0) |
+                                                (zc ? MSG_ZEROCOPY : 0));
+            if (sent == -1) {
+                if (zc && errno == ENOBUFS) {
+                    // too many zero-copy sends in flight; copy this one
+                    zc = 0;
+                } else if (errno != EINTR) {
+                    conn_kill(c);
+                }
+                continue;
+            }
+            if (zc) {
+                batch[0]->zc_id = c->zc_id++;
+                zc_sent = 1;
+            }
+            while (left > 0 && (size_t) sent >= v->iov_len) {
+                sent -= v->iov_len;
+                v++;
+                left--;
+            }
+            if (left > 0) {
+                v->iov_base = (char *) v->iov_base + sent;
+                v->iov_len -= sent;
+            }
+        }
+
+        atomic_fetch_sub(&c->queued, bytes);
+        if (zc_sent) {
+            zc_hold(c, batch[0]);
+            k = 0;
+        }
+        while (k > 0) {
+            chunk_free(batch[--k]);
+        }
+    }
+}
@@ -0,0 +1,113 @@
+#ifndef CONN_H
+#define CONN_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <stdint.h>
+#include "mpsc.h"
+
+// a chunk of output waiting in a connection's queue
+struct out_chunk {
+    struct mpsc_node link;
+    size_t len;
+    const char *data;            // buf, or shared data owned by the caller
+    void (*release)(void *);     // called for shared data once it is sent or dropped
+    void *arg;
+    int zerocopy;                // shared data large enough to send with MSG_ZEROCOPY
+    uint32_t zc_id;              // the kernel's number for its last zero-copy send
+    struct out_chunk *zc_next;   // sent zero-copy, waiting for the kernel to finish
+    char buf[];
+};
+
+struct relay;
+
+// per-connection state shared between the client thread and worker threads.
+// reference counted: the socket is closed only when the last reference goes,
+// so a worker holding a reference never writes to a reused descriptor
+struct conn {
+    int fd;
+    int wake_fd;                 // eventfd, readable when outq has chunks
+    atomic_int refs;
+    atomic_int wake_pending;     // set once a wakeup has been posted
+    struct mpsc_queue outq;      // filled by any thread, drained by the owner
+    atomic_int dead;             // a write failed or the client stopped reading
+    atomic_int binary;           // 1 once the client switched to binary framing
+    atomic_int jobs;             // worker jobs for this client's commands not yet done
+    uint32_t user_id;            // the client's user, 0 until it has been added
+    char *inbuf;                 // owner only: partial binary frame, or NULL
+    size_t inlen;
+    struct relay *relay;         // owner only: large message being relayed, or NULL
+    atomic_size_t queued;        // bytes waiting in outq
+    struct timespec flush_at;    // owner only: when held-back output is due
+    int flush_armed;
+    struct mpsc_node park_link;  // on the park thread's arrivals while handed over
+    int parked;                  // park thread only: 1 while watched for a wakeup
+    int zc_on;                   // SO_ZEROCOPY is set on the socket
+    uint32_t zc_id;              // owner only: number the kernel gives the next zero-copy send
+    struct out_chunk *zc_head;   // owner only: zero-copy chunks not yet completed, oldest first
+    struct out_chunk *zc_tail;
+};
+
+// turn on egress coalescing: output is queued and written in one go once it
+// has waited window_us microseconds or reached max_bytes. Call before any
+// connection exists; a window of 0 leaves it off
+void conn_coalesce(long window_us, size_t max_bytes);
+
+// send shared data of at least min_bytes with MSG_ZEROCOPY. Call before any
+// connection exists; 0 leaves it off
+void conn_zerocopy(size_t min_bytes);
+
+// create a connection holding one reference, NULL on failure
+struct conn *conn_new(int fd);
+
+void conn_get(struct conn *c);
+
+// drop a reference; the last one closes the socket and frees queued output
+void conn_put(struct conn *c);
+
+// copy data onto the connection's output queue and wake its owner
+// safe from any thread, return 0 on success. Output to a dead connection
+// is dropped, and a client that lets CONN_QUEUE_MAX bytes pile up is killed
+int conn_queue(struct conn *c, const char *data, size_t len);
+
+// queue data without copying it, from any thread. release(arg) is called
+// once the data has been written or dropped, also when this fails. Large
+// data may go out zero-copy, in which case release waits until the kernel
+// reports it is done with the pages
+int conn_queue_ref(struct conn *c, const char *data, size_t len,
+                   void (*release)(void *), void *arg);
+
+// send data to the connection from any thread. Everything goes through the
+// output queue and is written by the owner, so writes from several threads
+// never interleave
+void conn_send(struct conn *c, const char *data, size_t len);
+
+// owner thread only: output queued from now on goes out with the owner's
+// next conn_flush, so producers need not wake it
+void conn_claim_flush(struct conn *c);
+
+// owner thread only: send everything queued so far. When coalescing, output
+// is held back until it is due unless force is set. A failed write kills
+// the connection and drops the rest of the queue
+void conn_flush(struct conn *c, int force);
+
+// owner thread only: read zero-copy completions from the socket's error
+// queue, which make it poll with POLLERR, and release the chunks they
+// cover; return how many were read
+int conn_reap(struct conn *c);
+
+// owner thread only, before the connection is let go: wait up to timeout_ms
+// for the kernel to finish with its zero-copy sends. Whatever is still in
+// flight when the last reference goes is discarded with a reset
+void conn_settle(struct conn *c, int timeout_ms);
+
+// mark the connection dead and shut the socket down, from any thread; the
+// owner's next read ends, and the descriptor is closed with the last reference
+void conn_kill(struct conn *c);
+
+// owner thread only: return 1 and the time left in *left while output is
+// being held back, 0 otherwise
+int conn_held(struct conn *c, struct timespec *left);
+
+#endif
@@ -0,0 +1,286 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "intern.h"
+
+#define INTERN_TOMB UINT32_MAX   // slot whose entry was removed
+#define INTERN_MIN_SLOTS 64
+
+static uint32_t name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    while (*name) {
+        h ^= (unsigned char) *name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void intern_init(struct intern_table *t) {
+    memset(t, 0, sizeof(*t));
+    t->next_id = 1;
+}
+
+// slot holding name, or the slot where it would go
+static uint32_t *find_slot(const struct intern_table *t, const char *name, int for_insert) {
+    uint32_t mask = t->nslots - 1;
+    uint32_t i = name_hash(name) & mask;
+    uint32_t *tomb = NULL;
+
+    while (1) {
+        uint32_t *slot = &t->slots[i];
+        if (*slot == 0) {
+            return (for_insert && tomb) ? tomb : slot;
+        }
+        if (*slot == INTERN_TOMB) {
+            if (!tomb) tomb = slot;
+        } else if (strcmp(t->names[*slot], name) == 0) {
+            return slot;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+static int rehash(struct intern_table *t, uint32_t nslots) {
+    uint32_t *old = t->slots;
+    uint32_t oldn = t->nslots;
+    uint32_t i;
+
+    t->slots = (uint32_t *) calloc(nslots, sizeof(uint32_t));
+    if (!t->slots) {
+        perror("calloc");
+        t->slots = old;
+        return -1;
+    }
+    t->nslots = nslots;
+    t->used = 0;
+    for (i = 0; i < oldn; i++) {
+        if (old[i] != 0 && old[i] != INTERN_TOMB) {
+            *find_slot(t, t->names[old[i]], 1) = old[i];
+            t->used++;
+        }
+    }
+    free(old);
+    return 0;
+}
+
+// make room for one more name, keeping the load factor under 3/4
+static int reserve_slot(struct intern_table *t) {
+    if (t->nslots == 0) {
+        return rehash(t, INTERN_MIN_SLOTS);
+    }
+    if ((t->used + 1) * 4 > t->nslots * 3) {
+        return rehash(t, t->nslots * 2);
+    }
+    return 0;
+}
+
+// binary search over the sorted ids, see intern_seek()
+static uint32_t lower_bound(const struct intern_table *t, const char *name, int after) {
+    uint32_t lo = 0, hi = t->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int c = strcmp(t->names[t->order[mid]], name);
+        if (c < 0 || (after && c == 0)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// the id's name must be set and must not be in the order yet
+static void order_insert(struct intern_table *t, uint32_t id) {
+    uint32_t pos = lower_bound(t, t->names[id], 0);
+    memmove(t->order + pos + 1, t->order + pos, (t->count - pos) * sizeof(uint32_t));
+    t->order[pos] = id;
+    t->count++;
+}
+
+// called before the id's name changes or goes away
+static void order_remove(struct intern_table *t, uint32_t id) {
+    uint32_t pos = lower_bound(t, t->names[id], 0);
+    if (pos < t->count && t->order[pos] == id) {
+        memmove(t->order + pos, t->order + pos + 1, (t->count - pos - 1) * sizeof(uint32_t));
+        t->count--;
+    }
+}
+
+static uint32_t new_id(struct intern_table *t) {
+    if (t->nfree > 0) {
+        return t->free_ids[--t->nfree];
+    }
+    if (t->next_id >= t->cap) {
+        uint32_t newcap = t->cap ? t->cap * 2 : 64;
+        void **objs = (void **) realloc(t->objs, newcap * sizeof(void *));
+        if (!objs) {
+            perror("realloc");
+            return 0;
+        }
+        t->objs = objs;
+        const char **names = (const char **) realloc(t->names, newcap * sizeof(char *));
+        if (!names) {
+            perror("realloc");
+            return 0;
+        }
+        t->names = names;
+        uint32_t *free_ids = (uint32_t *) realloc(t->free_ids, newcap * sizeof(uint32_t));
+        if (!free_ids) {
+            perror("realloc");
+            return 0;
+        }
+        t->free_ids = free_ids;
+        uint32_t *order = (uint32_t *) realloc(t->order, newcap * sizeof(uint32_t));
+        if (!order) {
+            perror("realloc");
+            return 0;
+        }
+        t->order = order;
+        memset(t->objs + t->cap, 0, (newcap - t->cap) * sizeof(void *));
+        t->cap = newcap;
+    }
+    return t->next_id++;
+}
+
+uint32_t intern_add(struct intern_table *t, const char *name, void *obj) {
+    if (reserve_slot(t) != 0) {
+        return 0;
+    }
+    uint32_t *slot = find_slot(t, name, 1);
+    if (*slot != 0 && *slot != INTERN_TOMB) {
+        return 0;   // name taken
+    }
+
+    uint32_t id = new_id(t);
+    if (id == 0) {
+        return 0;
+    }
+    if (*slot == 0) {
+        t->used++;
+    }
+    *slot = id;
+    t->objs[id] = obj;
+    t->names[id] = name;
+    order_insert(t, id);
+    return id;
+}
+
+void intern_remove(struct intern_table *t, uint32_t id) {
+    if (id == 0 || id >= t->next_id || t->objs[id] == NULL) {
+        return;
+    }
+    uint32_t *slot = find_slot(t, t->names[id], 0);
+    if (*slot == id) {
+        *slot = INTERN_TOMB;
+    }
+    order_remove(t, id);
+    t->objs[id] = NULL;
+    t->names[id] = NULL;
+    t->free_ids[t->nfree++] = id;
+}
+
+int intern_rename(struct intern_table *t, uint32_t id, const char *name, char *buf, size_t max) {
+    char copy[64];
+
+    if (id == 0 || id >= t->next_id || t->objs[id] == NULL) {
+        return -1;
+    }
+    // compare on the name as it will be stored
+    snprintf(copy, sizeof(copy) < max ? sizeof(copy) : max, "%s", name);
+    uint32_t other = intern_find(t, copy);
+    if (other == id) {
+        return 0;
+    }
+    if (other != 0 || reserve_slot(t) != 0) {
+        return -1;
+    }
+
+    uint32_t *slot = find_slot(t, t->names[id], 0);
+    if (*slot == id) {
+        *slot = INTERN_TOMB;
+    }
+    order_remove(t, id);
+    snprintf(buf, max, "%s", copy);
+    slot = find_slot(t, buf, 1);
+    if (*slot == 0) {
+        t->used++;
+    }
+    *slot = id;
+    order_insert(t, id);
+    return 0;
+}
+
+uint32_t intern_find(const struct intern_table *t, const char *name) {
+    if (t->nslots == 0) {
+        return 0;
+    }
+    uint32_t id = *find_slot(t, name, 0);
+    return id == INTERN_TOMB ? 0 : id;
+}
+
+void *intern_get(const struct intern_table *t, uint32_t id) {
+    if (id == 0 || id >= t->next_id) {
+        return NULL;
+    }
+    return t->objs[id];
+}
+
+uint32_t intern_limit(const struct intern_table *t) {
+    return t->next_id;
+}
+
+uint32_t intern_count(const struct intern_table *t) {
+    return t->count;
+}
+
+uint32_t intern_at(const struct intern_table *t, uint32_t pos) {
+    return pos < t->count ? t->order[pos] : 0;
+}
+
+uint32_t intern_seek(const struct intern_table *t, const char *name, int after) {
+    return lower_bound(t, name, after);
+}
+
+uint32_t intern_prefix_end(const struct intern_table *t, const char *prefix, uint32_t pos) {
+    size_t plen = strlen(prefix);
+    uint32_t hi = t->count;
+
+    // names from pos on that carry the prefix come first, so bisect on it
+    while (pos < hi) {
+        uint32_t mid = pos + (hi - pos) / 2;
+        if (strncmp(t->names[t->order[mid]], prefix, plen) <= 0) {
+            pos = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return pos;
+}
+
+void intern_free(struct intern_table *t) {
+    free(t->slots);
+    free(t->order);
+    free(t->objs);
+    free(t->names);
+    free(t->free_ids);
+    intern_init(t);
+}
+
+int bitmap_set(uint64_t **bits, uint32_t *words, uint32_t id) {
+    if (id / 64 >= *words) {
+        uint32_t newwords = *words ? *words : 1;
+        while (id / 64 >= newwords) {
+            newwords *= 2;
+        }
+        uint64_t *grown = (uint64_t *) realloc(*bits, newwords * sizeof(uint64_t));
+        if (!grown) {
+            perror("realloc");
+            return -1;
+        }
+        memset(grown + *words, 0, (newwords - *words) * sizeof(uint64_t));
+        *bits = grown;
+        *words = newwords;
+    }
+    (*bits)[id / 64] |= (uint64_t) 1 << (id % 64);
+    return 0;
+}
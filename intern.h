@@ -0,0 +1,79 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// maps names to dense 32-bit ids and ids back to objects. Ids start at 1
+// and freed ids are reused first, so they stay dense enough to index
+// arrays and bitmaps. The table keeps a pointer to each object's own name
+// buffer; rename through intern_rename() so the index stays in step.
+// Ids are also kept sorted by name, for ordered and prefix listings.
+struct intern_table {
+    uint32_t *slots;             // open addressing on name, holds ids
+    uint32_t nslots;             // power of two
+    uint32_t used;               // live entries plus tombstones
+    void **objs;                 // objs[id], NULL when the id is free
+    const char **names;          // names[id]
+    uint32_t cap;                // length of objs and names
+    uint32_t *free_ids;          // ids released for reuse
+    uint32_t nfree;
+    uint32_t next_id;            // lowest id never handed out
+    uint32_t *order;             // live ids sorted by name
+    uint32_t count;              // number of live ids
+};
+
+#define INTERN_TABLE_INIT { NULL, 0, 0, NULL, NULL, 0, NULL, 0, 1, NULL, 0 }
+
+void intern_init(struct intern_table *t);
+
+// give obj an id under name; return 0 if the name is taken or out of memory
+uint32_t intern_add(struct intern_table *t, const char *name, void *obj);
+
+// release an id
+void intern_remove(struct intern_table *t, uint32_t id);
+
+// move id to a new name, copied into the object's buffer buf of size max
+// return 0 on success, -1 if another id has the name or out of memory
+int intern_rename(struct intern_table *t, uint32_t id, const char *name, char *buf, size_t max);
+
+// id for name, 0 if none
+uint32_t intern_find(const struct intern_table *t, const char *name);
+
+// object for id, NULL if none
+void *intern_get(const struct intern_table *t, uint32_t id);
+
+// one past the largest id in use, for sizing id-indexed bitmaps
+uint32_t intern_limit(const struct intern_table *t);
+
+// number of live ids
+uint32_t intern_count(const struct intern_table *t);
+
+// id at position pos in name order, 0 if past the end
+uint32_t intern_at(const struct intern_table *t, uint32_t pos);
+
+// position of the first name >= name, or > name if after is set
+uint32_t intern_seek(const struct intern_table *t, const char *name, int after);
+
+// position one past the last name starting with prefix, searching from pos
+uint32_t intern_prefix_end(const struct intern_table *t, const char *prefix, uint32_t pos);
+
+// free the table's own storage
+void intern_free(struct intern_table *t);
+
+/////////////////// ID BITMAPS //////////////////////////
+
+static inline int bitmap_test(const uint64_t *bits, uint32_t words, uint32_t id) {
+    return id / 64 < words && (bits[id / 64] >> (id % 64)) & 1;
+}
+
+static inline void bitmap_clear(uint64_t *bits, uint32_t words, uint32_t id) {
+    if (id / 64 < words) {
+        bits[id / 64] &= ~((uint64_t) 1 << (id % 64));
+    }
+}
+
+// set a bit, growing the bitmap to cover id; return -1 if out of memory
+int bitmap_set(uint64_t **bits, uint32_t *words, uint32_t id);
+
+#endif
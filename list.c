@@ -7,6 +7,10 @@
 // global room list head
 struct room *room_head = NULL;
 
+// name <-> id indexes, changed under the write lock
+struct intern_table user_ids = INTERN_TABLE_INIT;
+struct intern_table room_ids = INTERN_TABLE_INIT;
+
 // insert link at the first location in user list
 struct node* insertFirstU(struct node *head, int socket, char *username) {
     if (findU(head, username) == NULL) {
@@ -16,10 +20,23 @@ struct node* insertFirstU(struct node *head, int socket, char *username) {
             return head;
         }
 
-        link->socket = socket;
         strncpy(link->username, username, sizeof(link->username) - 1);
         link->username[sizeof(link->username) - 1] = '\0';
+        link->id = intern_add(&user_ids, link->username, link);
+        if (link->id == 0) {
+            free(link);
+            return head;
+        }
+
+        link->socket = socket;
+        link->conn = NULL;
         link->dm_head = NULL;
+        link->acct = NULL;
+        link->joined = NULL;
+        link->trusted = 0;
+        link->uid = -1;
+        memset(&link->msg_tb, 0, sizeof(link->msg_tb));
+        memset(&link->byte_tb, 0, sizeof(link->byte_tb));
 
         link->next = head;
         head = link;
@@ -31,42 +48,48 @@ struct node* insertFirstU(struct node *head, int socket, char *username) {
 
 // find a node with given username
 struct node* findU(struct node *head, char* username) {
-    struct node* current = head;
-
-    if (head == NULL) {
-        return NULL;
-    }
+    return (struct node*) intern_get(&user_ids, intern_find(&user_ids, username));
+}
 
-    while (current != NULL && strcmp(current->username, username) != 0) {
-        current = current->next;
-    }
+// find a node with given id
+struct node* findUById(struct node *head, uint32_t id) {
+    return (struct node*) intern_get(&user_ids, id);
+}
 
-    return current;
+// rename a user, keeping the name index in step
+int renameU(struct node *user, char *username) {
+    return intern_rename(&user_ids, user->id, username, user->username, sizeof(user->username));
 }
 
-// find a node with given socket
-struct node* findUBySocket(struct node *head, int socket) {
-    struct node *current = head;
-    while (current != NULL) {
-        if (current->socket == socket) {
-            return current;
+// unlink a user from the list, release its id and free it
+struct node* removeU(struct node *head, struct node *user) {
+    struct node *cur = head;
+    struct node *prev = NULL;
+    while (cur != NULL) {
+        if (cur == user) {
+            if (prev == NULL) {
+                head = cur->next;
+            } else {
+                prev->next = cur->next;
+            }
+            intern_remove(&user_ids, cur->id);
+            free(cur);
+            break;
         }
-        current = current->next;
+        prev = cur;
+        cur = cur->next;
     }
-    return NULL;
+    return head;
 }
 
 ////////////////////// ROOM HELPERS /////////////////////////
 
 struct room* findRoom(char *roomname) {
-    struct room *curr = room_head;
-    while (curr != NULL) {
-        if (strcmp(curr->name, roomname) == 0) {
-            return curr;
-        }
-        curr = curr->next;
-    }
-    return NULL;
+    return (struct room*) intern_get(&room_ids, intern_find(&room_ids, roomname));
+}
+
+struct room* findRoomById(uint32_t id) {
+    return (struct room*) intern_get(&room_ids, id);
 }
 
 struct room* createRoom(char *roomname) {
@@ -83,7 +106,22 @@ struct room* createRoom(char *roomname) {
 
     strncpy(r->name, roomname, sizeof(r->name) - 1);
     r->name[sizeof(r->name) - 1] = '\0';
+    r->id = intern_add(&room_ids, r->name, r);
+    if (r->id == 0) {
+        free(r);
+        return NULL;
+    }
     r->users = NULL;
+    r->members = NULL;
+    r->member_words = 0;
+    r->member_count = 0;
+    memset(&r->fanout, 0, sizeof(r->fanout));
+    mpsc_init(&r->inbox);
+    atomic_init(&r->scheduled, 0);
+    atomic_init(&r->owner, -1);
+    r->load = 0;
+    r->last_load = 0;
+    r->load_epoch = 0;
 
     // insert at front of global room list
     r->next = room_head;
@@ -96,12 +134,8 @@ int addUserToRoom(struct room *room, struct node *user) {
     if (!room || !user) return -1;
 
     // check if already in room
-    struct room_user *cur = room->users;
-    while (cur != NULL) {
-        if (cur->user == user) {
-            return 0;   // already in room
-        }
-        cur = cur->next;
+    if (inRoom(room, user)) {
+        return 0;
     }
 
     struct room_user *ru = (struct room_user*) malloc(sizeof(struct room_user));
@@ -109,15 +143,25 @@ int addUserToRoom(struct room *room, struct node *user) {
         perror("malloc");
         return -1;
     }
+    if (bitmap_set(&room->members, &room->member_words, user->id) != 0) {
+        free(ru);
+        return -1;
+    }
     ru->user = user;
     ru->next = room->users;
     room->users = ru;
+    room->member_count++;
 
     return 0;
 }
 
+int inRoom(struct room *room, struct node *user) {
+    return bitmap_test(room->members, room->member_words, user->id);
+}
+
 int removeUserFromRoom(struct room *room, struct node *user) {
     if (!room || !user) return -1;
+    if (!inRoom(room, user)) return -1;
 
     struct room_user *cur = room->users;
     struct room_user *prev = NULL;
@@ -130,6 +174,8 @@ int removeUserFromRoom(struct room *room, struct node *user) {
                 prev->next = cur->next;
             }
             free(cur);
+            bitmap_clear(room->members, room->member_words, user->id);
+            room->member_count--;
             return 0;
         }
         prev = cur;
@@ -138,36 +184,18 @@ int removeUserFromRoom(struct room *room, struct node *user) {
     return -1;
 }
 
-void listUsers(struct node *user_head, char *buffer, int maxlen) {
-    buffer[0] = '\0';
-    strncat(buffer, "Users:\n", maxlen - strlen(buffer) - 1);
-
-    struct node *cur = user_head;
-    while (cur != NULL) {
-        if ((int)strlen(buffer) >= maxlen - 40) break;
-
-        strncat(buffer, "  ", maxlen - strlen(buffer) - 1);
-        strncat(buffer, cur->username, maxlen - strlen(buffer) - 1);
-        strncat(buffer, "\n", maxlen - strlen(buffer) - 1);
-
-        cur = cur->next;
+// unlink a room from the room list, release its id and free it
+void deleteRoom(struct room *room) {
+    struct room **link = &room_head;
+    while (*link != NULL && *link != room) {
+        link = &(*link)->next;
     }
-}
-
-void listRooms(struct room *head, char *buffer, int maxlen) {
-    buffer[0] = '\0';
-    strncat(buffer, "Rooms:\n", maxlen - strlen(buffer) - 1);
-
-    struct room *cur = head;
-    while (cur != NULL) {
-        if ((int)strlen(buffer) >= maxlen - 40) break;
-
-        strncat(buffer, "  ", maxlen - strlen(buffer) - 1);
-        strncat(buffer, cur->name, maxlen - strlen(buffer) - 1);
-        strncat(buffer, "\n", maxlen - strlen(buffer) - 1);
-
-        cur = cur->next;
+    if (*link == room) {
+        *link = room->next;
     }
+    intern_remove(&room_ids, room->id);
+    free(room->members);
+    free(room);
 }
 
 // delete empty rooms except the default room name
@@ -188,6 +216,8 @@ void deleteEmptyRooms(const char *default_room_name) {
                 prev->next = cur->next;
                 cur = cur->next;
             }
+            intern_remove(&room_ids, tmp->id);
+            free(tmp->members);
             free(tmp);
         } else {
             prev = cur;
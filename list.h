@@ -5,12 +5,28 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "ratelimit.h"
+#include "mpsc.h"
+#include "intern.h"
+#include "actor.h"
 
 // Forward declarations so we can use pointers between structs
 struct node;
 struct room;
 struct room_user;
 struct dm_conn;
+struct conn;
+struct room_ref;
+struct account;
+
+// rooms a user has joined, kept in actor mode; only the user's own thread
+// changes the list, under the write lock
+struct room_ref {
+    struct room *room;
+    struct room_ref *next;
+};
 
 // DM connections per user
 struct dm_conn {
@@ -21,9 +37,18 @@ struct dm_conn {
 // user node
 struct node {
     char username[30];
+    uint32_t id;                 // interned, dense; reused after the user leaves
     int socket;
+    struct conn *conn;           // connection state, owned by the client thread
     struct node *next;
     struct dm_conn *dm_head;   // head of DM connections list
+    struct account *acct;        // identity kept across reconnects, NULL for guests
+    struct room_ref *joined;     // actor mode only, owner thread only
+    struct token_bucket msg_tb;  // messages per second, owner thread only
+    struct token_bucket byte_tb; // input bytes per second, owner thread only
+    int trusted;                 // local peer with the trusted uid, not flood limited
+    long uid;                    // Unix peer's uid, -1 over TCP; owns the account
+    struct actor_sync room_ops;  // actor mode: joins and leaves the owners have not applied
 };
 
 // room membership node (linked list of users in a room)
@@ -35,43 +60,73 @@ struct room_user {
 // room list node
 struct room {
     char name[30];
+    uint32_t id;                 // interned, dense; reused after the room is deleted
     struct room_user *users;     // linked list of users in this room
+    uint64_t *members;           // bitmap of member user ids
+    uint32_t member_words;
+    int member_count;
+    struct token_bucket fanout;  // recipient sends per second, zeroed until first use
+
+    // actor mode: only the owning actor touches users and fanout
+    struct mpsc_queue inbox;     // join / leave / message requests
+    struct mpsc_node sched;      // link on the owner's mailbox
+    atomic_int scheduled;        // 1 while queued on or run by an actor
+    atomic_int owner;            // actor index, -1 until first use
+    unsigned long load;          // work done in the current window
+    unsigned long last_load;     // work done in the previous window
+    long load_epoch;
+
     struct room *next;
 };
 
 /////////////////// USERLIST //////////////////////////
 
+// name <-> id index of connected users, defined in list.c
+extern struct intern_table user_ids;
+
 // insert node at the first location (if username not already present)
 struct node* insertFirstU(struct node *head, int socket, char *username);
 
 // find a node with given username
 struct node* findU(struct node *head, char* username);
 
-// find a node with given socket
-struct node* findUBySocket(struct node *head, int socket);
+// find a node with given id
+struct node* findUById(struct node *head, uint32_t id);
+
+// rename a user; return -1 if another user has the name
+int renameU(struct node *user, char *username);
+
+// unlink a user, release its id and free it; return the new head
+struct node* removeU(struct node *head, struct node *user);
 
 /////////////////// ROOMLIST //////////////////////////
 
 // global head of room list, defined in list.c
 extern struct room *room_head;
 
+// name <-> id index of rooms, defined in list.c
+extern struct intern_table room_ids;
+
 // find room by name
 struct room* findRoom(char *roomname);
 
+// find room by id
+struct room* findRoomById(uint32_t id);
+
 // create room, return pointer (creates if missing)
 struct room* createRoom(char *roomname);
 
 // add user to room
 int addUserToRoom(struct room *room, struct node *user);
 
+// return 1 if user is a member of room
+int inRoom(struct room *room, struct node *user);
+
 // remove user from room
 int removeUserFromRoom(struct room *room, struct node *user);
 
-// list rooms into buffer
-void listRooms(struct room *head, char *buffer, int maxlen);
-
-// list users into buffer
-void listUsers(struct node *user_head, char *buffer, int maxlen);
+// unlink a room, release its id and free it
+void deleteRoom(struct room *room);
 
 // delete empty rooms except the default room name
 void deleteEmptyRooms(const char *default_room_name);
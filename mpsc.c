@@ -0,0 +1,53 @@
+#include <stddef.h>
+#include "mpsc.h"
+
+void mpsc_init(struct mpsc_queue *q) {
+    atomic_store_explicit(&q->stub.next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&q->head, &q->stub, memory_order_relaxed);
+    atomic_store_explicit(&q->tail, &q->stub, memory_order_relaxed);
+}
+
+void mpsc_push(struct mpsc_queue *q, struct mpsc_node *n) {
+    atomic_store_explicit(&n->next, NULL, memory_order_relaxed);
+    struct mpsc_node *prev = atomic_exchange_explicit(&q->head, n, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, n, memory_order_release);
+}
+
+struct mpsc_node *mpsc_pop(struct mpsc_queue *q) {
+    struct mpsc_node *tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    struct mpsc_node *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    // skip over the stub
+    if (tail == &q->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        atomic_store_explicit(&q->tail, next, memory_order_relaxed);
+        tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+
+    if (next != NULL) {
+        atomic_store_explicit(&q->tail, next, memory_order_relaxed);
+        return tail;
+    }
+
+    // tail is the last linked node; only take it if no push is in flight
+    if (tail != atomic_load_explicit(&q->head, memory_order_acquire)) {
+        return NULL;
+    }
+
+    // put the stub back behind it so tail can be handed out
+    mpsc_push(q, &q->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next != NULL) {
+        atomic_store_explicit(&q->tail, next, memory_order_relaxed);
+        return tail;
+    }
+    return NULL;
+}
+
+int mpsc_empty(struct mpsc_queue *q) {
+    return atomic_load_explicit(&q->tail, memory_order_relaxed) == &q->stub &&
+           atomic_load_explicit(&q->head, memory_order_acquire) == &q->stub;
+}
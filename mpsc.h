@@ -0,0 +1,36 @@
+#ifndef MPSC_H
+#define MPSC_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+// intrusive multi-producer / single-consumer lock-free queue (Vyukov)
+// embed a struct mpsc_node in each item and recover it with container_of
+struct mpsc_node {
+    _Atomic(struct mpsc_node *) next;
+};
+
+struct mpsc_queue {
+    _Atomic(struct mpsc_node *) head;   // producers swap themselves in here
+    _Atomic(struct mpsc_node *) tail;   // consumer side; atomic so mpsc_empty
+                                        // may look after a room changes hands
+    struct mpsc_node stub;
+};
+
+#define container_of(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
+void mpsc_init(struct mpsc_queue *q);
+
+// push from any thread
+void mpsc_push(struct mpsc_queue *q, struct mpsc_node *n);
+
+// pop from the consumer thread only; returns NULL when empty, or when a
+// producer is halfway through a push (it will be seen on the next pop)
+struct mpsc_node *mpsc_pop(struct mpsc_queue *q);
+
+// return 1 if nothing is queued or being pushed; exact for the consumer,
+// a hint for any other thread
+int mpsc_empty(struct mpsc_queue *q);
+
+#endif
@@ -0,0 +1,392 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "list.h"
+#include "protocol.h"
+#include "offline.h"
+
+#define OFFLINE_ACCOUNTS 65536   // accounts kept before the least recently seen go
+#define MAILBOX_MIN 256          // first allocation of a mailbox ring
+
+// name index of accounts, changed under the write lock
+static struct intern_table account_ids = INTERN_TABLE_INIT;
+
+// offline accounts, most recently seen first; changed under the write lock
+static struct account *lru_head = NULL, *lru_tail = NULL;
+
+// mailbox contents and the byte count, taken with the read or write lock held
+static pthread_mutex_t offline_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t mailbox_max = 0;
+static size_t total_max = 0;
+static size_t total_bytes = 0;  // allocated to mailboxes
+static int open_accounts = 0;   // TCP clients get accounts too
+
+void offline_init(size_t mailbox_bytes, size_t total, int open) {
+    mailbox_max = mailbox_bytes;
+    total_max = total;
+    open_accounts = open;
+}
+
+////////////////////// MAILBOX RING /////////////////////////
+
+static void ring_read(const struct mailbox *mb, uint32_t off, void *dst, uint32_t n) {
+    uint32_t at = (mb->head + off) % mb->cap;
+    uint32_t first = mb->cap - at < n ? mb->cap - at : n;
+    memcpy(dst, mb->buf + at, first);
+    memcpy((char *) dst + first, mb->buf, n - first);
+}
+
+static void ring_write(struct mailbox *mb, uint32_t off, const void *src, uint32_t n) {
+    uint32_t at = (mb->head + off) % mb->cap;
+    uint32_t first = mb->cap - at < n ? mb->cap - at : n;
+    memcpy(mb->buf + at, src, first);
+    memcpy(mb->buf, (const char *) src + first, n - first);
+}
+
+static void ring_drop_oldest(struct mailbox *mb) {
+    uint32_t rec;
+    ring_read(mb, 0, &rec, 4);
+    mb->head = (mb->head + rec) % mb->cap;
+    mb->len -= rec;
+    mb->count--;
+}
+
+static void ring_release(struct mailbox *mb) {
+    total_bytes -= mb->cap;
+    free(mb->buf);
+    memset(mb, 0, sizeof(*mb));
+}
+
+// grow a ring to newcap bytes, laying its records out from offset 0
+static int ring_grow(struct mailbox *mb, uint32_t newcap) {
+    char *buf = (char *) malloc(newcap);
+    if (!buf) {
+        perror("malloc");
+        return -1;
+    }
+    if (mb->len > 0) {
+        ring_read(mb, 0, buf, mb->len);
+    }
+    free(mb->buf);
+    total_bytes += newcap - mb->cap;
+    mb->buf = buf;
+    mb->cap = newcap;
+    mb->head = 0;
+    return 0;
+}
+
+// empty the mailboxes of the accounts seen least recently until want more
+// bytes fit under the global cap; keep never gives its mailbox up
+static void evict_mail(size_t want, struct account *keep) {
+    struct account *a;
+    for (a = lru_tail; a != NULL && total_bytes + want > total_max; a = a->prev) {
+        if (a != keep && a->box.buf != NULL) {
+            ring_release(&a->box);
+        }
+    }
+}
+
+// append a record, dropping the oldest ones when the mailbox is full
+static int mailbox_put(struct account *a, const char *name, const char *body, size_t len) {
+    struct mailbox *mb = &a->box;
+    uint8_t nl = (uint8_t) strlen(name);
+    uint32_t rec = 4 + 1 + nl + (uint32_t) len;
+
+    if (rec > mailbox_max) {
+        return 0;
+    }
+    if (mb->len + rec > mb->cap && mb->cap < mailbox_max) {
+        uint32_t newcap = mb->cap ? mb->cap : MAILBOX_MIN;
+        while (newcap < mb->len + rec && newcap < mailbox_max) {
+            newcap *= 2;
+        }
+        if (newcap > mailbox_max) {
+            newcap = mailbox_max;
+        }
+        evict_mail(newcap - mb->cap, a);
+        if (total_bytes + newcap - mb->cap <= total_max) {
+            ring_grow(mb, newcap);
+        }
+    }
+    if (rec > mb->cap) {
+        return 0;   // no memory left for it
+    }
+    while (mb->len + rec > mb->cap) {
+        ring_drop_oldest(mb);
+    }
+
+    ring_write(mb, mb->len, &rec, 4);
+    ring_write(mb, mb->len + 4, &nl, 1);
+    ring_write(mb, mb->len + 5, name, nl);
+    ring_write(mb, mb->len + 5 + nl, body, (uint32_t) len);
+    mb->len += rec;
+    mb->count++;
+    return 1;
+}
+
+////////////////////// ACCOUNTS /////////////////////////
+
+static void lru_unlink(struct account *a) {
+    if (a->prev) a->prev->next = a->next; else if (lru_head == a) lru_head = a->next;
+    if (a->next) a->next->prev = a->prev; else if (lru_tail == a) lru_tail = a->prev;
+    a->prev = a->next = NULL;
+}
+
+static void lru_push(struct account *a) {
+    a->prev = NULL;
+    a->next = lru_head;
+    if (lru_head) lru_head->prev = a;
+    lru_head = a;
+    if (!lru_tail) lru_tail = a;
+}
+
+static int has_peer(struct account *a, struct account *b) {
+    struct account_ref *ref;
+    for (ref = a->peers; ref != NULL; ref = ref->next) {
+        if (ref->acct == b) return 1;
+    }
+    return 0;
+}
+
+static void drop_peer(struct account *a, struct account *b) {
+    struct account_ref *ref = a->peers, *prev = NULL;
+    while (ref != NULL) {
+        if (ref->acct == b) {
+            if (prev) prev->next = ref->next; else a->peers = ref->next;
+            free(ref);
+            return;
+        }
+        prev = ref;
+        ref = ref->next;
+    }
+}
+
+static void account_destroy(struct account *a) {
+    while (a->peers != NULL) {
+        struct account *peer = a->peers->acct;
+        drop_peer(peer, a);
+        drop_peer(a, peer);
+    }
+    pthread_mutex_lock(&offline_lock);
+    ring_release(&a->box);
+    pthread_mutex_unlock(&offline_lock);
+    intern_remove(&account_ids, a->id);
+    free(a);
+}
+
+// set a as user's account and set up DMs with its peers who are online
+static struct account *account_attach(struct account *a, struct node *user) {
+    struct account_ref *ref;
+
+    lru_unlink(a);
+    a->user = user;
+    for (ref = a->peers; ref != NULL; ref = ref->next) {
+        if (ref->acct->user) {
+            addDM(user, ref->acct->user);
+        }
+    }
+    return a;
+}
+
+struct account *account_login(struct node *user) {
+    struct account *a = (struct account *) intern_get(&account_ids, intern_find(&account_ids, user->username));
+
+    if (a != NULL && a->uid != user->uid) {
+        return NULL;   // made by another uid, or by TCP and this is a local peer
+    }
+    if (a == NULL) {
+        // a TCP client proves nothing about its name, so it only gets an
+        // account, and the DMs and mail that come with it, when allowed
+        if (user->uid < 0 && !open_accounts) {
+            return NULL;
+        }
+        // make room by forgetting the account seen least recently
+        if (intern_count(&account_ids) >= OFFLINE_ACCOUNTS) {
+            struct account *old = lru_tail;
+            if (old == NULL) {
+                return NULL;
+            }
+            lru_unlink(old);
+            account_destroy(old);
+        }
+        a = (struct account *) calloc(1, sizeof(struct account));
+        if (!a) {
+            perror("calloc");
+            return NULL;
+        }
+        snprintf(a->name, sizeof(a->name), "%s", user->username);
+        a->uid = user->uid;
+        a->id = intern_add(&account_ids, a->name, a);
+        if (a->id == 0) {
+            free(a);
+            return NULL;
+        }
+    }
+    return account_attach(a, user);
+}
+
+struct account *account_rename(struct account *a, struct node *user) {
+    struct account *b = (struct account *) intern_get(&account_ids, intern_find(&account_ids, user->username));
+
+    if (b == a) {
+        return a;
+    }
+    if (b == NULL) {
+        if (intern_rename(&account_ids, a->id, user->username, a->name, sizeof(a->name)) == 0) {
+            return a;
+        }
+        // out of memory: the old name must not keep collecting mail
+    } else if (b->uid == a->uid) {
+        // the owner's other account: it takes over a's peers. a is online,
+        // so its mailbox is already empty
+        struct account_ref *ref;
+        for (ref = a->peers; ref != NULL; ref = ref->next) {
+            account_link(b, ref->acct);
+        }
+        account_destroy(a);
+        return account_attach(b, user);
+    }
+    account_destroy(a);
+    return NULL;
+}
+
+void account_logout(struct account *a) {
+    a->user = NULL;
+    lru_push(a);
+}
+
+void account_link(struct account *a, struct account *b) {
+    if (a == b || has_peer(a, b)) {
+        return;
+    }
+    struct account_ref *ab = (struct account_ref *) malloc(sizeof(struct account_ref));
+    struct account_ref *ba = (struct account_ref *) malloc(sizeof(struct account_ref));
+    if (!ab || !ba) {
+        perror("malloc");
+        free(ab);
+        free(ba);
+        return;
+    }
+    ab->acct = b;
+    ab->next = a->peers;
+    a->peers = ab;
+    ba->acct = a;
+    ba->next = b->peers;
+    b->peers = ba;
+}
+
+void account_unlink(struct account *a, struct account *b) {
+    drop_peer(a, b);
+    drop_peer(b, a);
+}
+
+int account_store(struct account *from, const char *body, size_t len) {
+    struct account_ref *ref;
+    int stored = 0;
+
+    // the text line ending is added back when the mail is read, and a
+    // record has to fit in one binary frame
+    while (len > 0 && (body[len - 1] == '\n' || body[len - 1] == '\r')) {
+        len--;
+    }
+    size_t fit = BIN_MAX_FRAME - BIN_HEADER - 1 - strlen(from->name);
+    if (len > fit) {
+        len = fit;
+    }
+    if (mailbox_max == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&offline_lock);
+    for (ref = from->peers; ref != NULL; ref = ref->next) {
+        if (ref->acct->user == NULL) {
+            stored += mailbox_put(ref->acct, from->name, body, len);
+        }
+    }
+    pthread_mutex_unlock(&offline_lock);
+    return stored;
+}
+
+size_t account_take_mail(struct account *a, int binary, char **out) {
+    struct mailbox *mb = &a->box;
+    size_t off = 0;
+
+    *out = NULL;
+    pthread_mutex_lock(&offline_lock);
+    if (mb->count == 0) {
+        pthread_mutex_unlock(&offline_lock);
+        return 0;
+    }
+
+    // text: "\n::" name "> " body "\n" per record, one prompt at the end;
+    // binary: a STORED frame per record
+    size_t size = mb->len + mb->count * (BIN_HEADER + 6) + 6;
+    char *buf = (char *) malloc(size);
+    if (!buf) {
+        perror("malloc");
+        pthread_mutex_unlock(&offline_lock);
+        return 0;
+    }
+
+    uint32_t pos = 0;
+    while (pos < mb->len) {
+        uint32_t rec;
+        uint8_t nl;
+        ring_read(mb, pos, &rec, 4);
+        ring_read(mb, pos + 4, &nl, 1);
+        uint32_t bl = rec - 5 - nl;
+
+        if (binary) {
+            off += bin_header(buf + off, OP_STORED, 1 + nl + bl);
+            buf[off++] = (char) nl;
+            ring_read(mb, pos + 5, buf + off, nl + bl);
+            off += nl + bl;
+        } else {
+            memcpy(buf + off, "\n::", 3);
+            off += 3;
+            ring_read(mb, pos + 5, buf + off, nl);
+            off += nl;
+            memcpy(buf + off, "> ", 2);
+            off += 2;
+            ring_read(mb, pos + 5 + nl, buf + off, bl);
+            off += bl;
+            buf[off++] = '\n';
+        }
+        pos += rec;
+    }
+    if (!binary) {
+        memcpy(buf + off, "chat>", 5);
+        off += 5;
+    }
+    ring_release(mb);
+    pthread_mutex_unlock(&offline_lock);
+
+    *out = buf;
+    return off;
+}
+
+void offline_stats(uint32_t *accounts, size_t *mail_bytes) {
+    *accounts = intern_count(&account_ids);
+    pthread_mutex_lock(&offline_lock);
+    *mail_bytes = total_bytes;
+    pthread_mutex_unlock(&offline_lock);
+}
+
+void offline_free(void) {
+    uint32_t pos;
+    // collect first, destroying edits the index
+    uint32_t n = intern_count(&account_ids);
+    struct account **all = (struct account **) malloc((n ? n : 1) * sizeof(struct account *));
+    if (!all) {
+        return;
+    }
+    for (pos = 0; pos < n; pos++) {
+        all[pos] = (struct account *) intern_get(&account_ids, intern_at(&account_ids, pos));
+    }
+    for (pos = 0; pos < n; pos++) {
+        account_destroy(all[pos]);
+    }
+    free(all);
+    intern_free(&account_ids);
+    lru_head = lru_tail = NULL;
+}
@@ -0,0 +1,77 @@
+#ifndef OFFLINE_H
+#define OFFLINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+struct node;
+
+// messages waiting for an offline user, in a byte ring that grows up to the
+// per-user cap. Each record is u32 length, u8 name length, sender, body
+struct mailbox {
+    char *buf;
+    uint32_t cap;                // bytes allocated
+    uint32_t head;               // offset of the oldest record
+    uint32_t len;                // bytes in use
+    uint32_t count;              // records
+};
+
+struct account_ref {
+    struct account *acct;
+    struct account_ref *next;
+};
+
+// a login name that outlives the connection using it, so DM peers and
+// waiting messages survive a reconnect. Guests have none. An account made
+// over a Unix socket belongs to the peer's uid; one made over TCP belongs
+// to whoever logs in with the name next
+struct account {
+    char name[30];
+    uint32_t id;                 // in the account name index
+    long uid;                    // owner's SO_PEERCRED uid, -1 if unverified
+    struct node *user;           // logged in as this name, or NULL
+    struct account_ref *peers;   // DM peers kept across reconnects
+    struct mailbox box;          // under offline_lock
+    struct account *prev, *next; // offline accounts, most recently seen first
+};
+
+// set the per-user and global mailbox caps in bytes; open gives TCP
+// clients accounts as well, owned by nobody
+void offline_init(size_t mailbox_bytes, size_t total_bytes, int open);
+
+// the following take the write lock unless noted
+
+// tie user to the account for its name, creating it if needed, and
+// reconnect DMs with peers who are online. NULL if the name's account has
+// another owner, if user is a TCP client and accounts are not open, or if no
+// account could be made
+struct account *account_login(struct node *user);
+
+// user, holding a, has taken a new name: move a to it, or fold a into the
+// new name's account when the same owner has one. NULL and a is forgotten
+// if the new name belongs to someone else
+struct account *account_rename(struct account *a, struct node *user);
+
+// the user holding the account is leaving; its peers and mail are kept
+void account_logout(struct account *a);
+
+// remember or forget a DM relationship between two accounts
+void account_link(struct account *a, struct account *b);
+void account_unlink(struct account *a, struct account *b);
+
+// read lock is enough: store a message in the mailbox of every offline peer
+// of from; return how many got it
+int account_store(struct account *from, const char *body, size_t len);
+
+// read lock is enough: encode and empty the account's mailbox for the
+// user's protocol; return the length of *out, which the caller frees
+size_t account_take_mail(struct account *a, int binary, char **out);
+
+// read lock is enough: accounts kept and bytes allocated to mailboxes
+void offline_stats(uint32_t *accounts, size_t *mail_bytes);
+
+// free every account, at shutdown
+void offline_free(void);
+
+#endif
@@ -0,0 +1,287 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "park.h"
+#include "conn.h"
+#include "placement.h"
+#include "trace.h"
+
+#define PARK_EVENTS 64           // readiness events taken per epoll_wait()
+#define STACK_CACHE 64           // emptied client stacks kept for reuse
+#define TRIM_MS 1000             // quiet time after parking before free heap is returned
+
+// a client thread's stack. The C library keeps the stacks of finished
+// threads with their touched pages, so client threads get stacks mapped
+// here, which are emptied once the thread has been joined
+struct client_stack {
+    struct mpsc_node link;       // on exits once the thread is done with it
+    pthread_t tid;
+    void *(*fn)(void *);
+    void *arg;
+    char *base;                  // a guard page, then the stack
+    struct client_stack *next;   // in the cache
+};
+
+static int epoll_fd = -1;
+static int arrive_fd = -1;       // eventfd, readable when arrivals or exits has entries
+static struct mpsc_queue arrivals;   // connections handed over by client threads
+static struct mpsc_queue exits;      // stacks of client threads that are finishing
+static atomic_int running = 0;
+static atomic_int parked = 0;
+
+// spawn_attr and the stack cache, used by the accept loop and the park thread
+static pthread_mutex_t spawn_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_attr_t spawn_attr;
+static struct client_stack *cache = NULL;
+static int ncached = 0;
+static size_t stack_bytes;       // without the guard page
+static size_t page_bytes;
+
+// owned by the park thread
+static void *(*resume_fn)(void *);
+static void (*drop_fn)(struct conn *);
+
+////////////////////// STACKS /////////////////////////
+
+// under spawn_lock
+static struct client_stack *stack_get(void) {
+    struct client_stack *st = cache;
+    if (st != NULL) {
+        cache = st->next;
+        ncached--;
+        return st;
+    }
+
+    st = (struct client_stack *) malloc(sizeof(struct client_stack));
+    if (!st) {
+        perror("malloc");
+        return NULL;
+    }
+    st->base = (char *) mmap(NULL, page_bytes + stack_bytes, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (st->base == MAP_FAILED) {
+        perror("mmap");
+        free(st);
+        return NULL;
+    }
+    mprotect(st->base, page_bytes, PROT_NONE);
+    return st;
+}
+
+// give a stack no thread runs on back, emptied
+static void stack_put(struct client_stack *st) {
+    pthread_mutex_lock(&spawn_lock);
+    int keep = ncached < STACK_CACHE;
+    if (keep) {
+        st->next = cache;
+        cache = st;
+        ncached++;
+    }
+    pthread_mutex_unlock(&spawn_lock);
+
+    if (keep) {
+        madvise(st->base + page_bytes, stack_bytes, MADV_DONTNEED);
+    } else {
+        munmap(st->base, page_bytes + stack_bytes);
+        free(st);
+    }
+}
+
+static void *client_main(void *arg) {
+    struct client_stack *st = (struct client_stack *) arg;
+    uint64_t one = 1;
+
+    st->tid = pthread_self();
+    st->fn(st->arg);
+
+    // the park thread joins this thread before the stack is emptied
+    mpsc_push(&exits, &st->link);
+    if (write(arrive_fd, &one, sizeof(one)) == -1) {
+        perror("eventfd write");
+    }
+    return NULL;
+}
+
+int park_spawn(void *(*fn)(void *), void *arg, int sock) {
+    pthread_t tid;
+    int rc = -1;
+
+    pthread_mutex_lock(&spawn_lock);
+    struct client_stack *st = stack_get();
+    if (st != NULL) {
+        st->fn = fn;
+        st->arg = arg;
+        place_client(&spawn_attr, sock);
+        pthread_attr_setstack(&spawn_attr, st->base + page_bytes, stack_bytes);
+        rc = pthread_create(&tid, &spawn_attr, client_main, st);
+    }
+    pthread_mutex_unlock(&spawn_lock);
+
+    if (st != NULL && rc != 0) {
+        perror("pthread_create");
+        stack_put(st);
+    }
+    return rc == 0 ? 0 : -1;
+}
+
+////////////////////// PARKED CONNECTIONS /////////////////////////
+
+// watch both of a connection's descriptors; a readable one wakes it. Only
+// the park thread changes the epoll set, so nothing races a registration
+static void watch(struct conn *c) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = c;
+
+    c->parked = 1;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &ev) == -1 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->wake_fd, &ev) == -1) {
+        perror("epoll_ctl");
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+        c->parked = 0;   // can't watch it, so serve it right away
+        atomic_fetch_sub(&parked, 1);
+    }
+}
+
+// stop watching a connection; return 0 if it was not parked, as for the
+// second descriptor of a connection already woken in this batch
+static int unwatch(struct conn *c) {
+    if (!c->parked) {
+        return 0;
+    }
+    c->parked = 0;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->wake_fd, NULL);
+    atomic_fetch_sub(&parked, 1);
+    return 1;
+}
+
+static void resume(struct conn *c) {
+    if (park_spawn(resume_fn, c, c->fd) == -1) {
+        drop_fn(c);
+    }
+}
+
+// take in parked connections and reap finished threads; return 1 if
+// anything came, so free memory is worth handing back later
+static int drain_arrivals(void) {
+    struct mpsc_node *node;
+    uint64_t count;
+    int any = 0;
+
+    if (read(arrive_fd, &count, sizeof(count)) == -1) {
+        // drained by an earlier batch
+    }
+    while ((node = mpsc_pop(&exits)) != NULL) {
+        struct client_stack *st = container_of(node, struct client_stack, link);
+        pthread_join(st->tid, NULL);
+        stack_put(st);
+        any = 1;
+    }
+    while ((node = mpsc_pop(&arrivals)) != NULL) {
+        struct conn *c = container_of(node, struct conn, park_link);
+        watch(c);
+        if (!c->parked) {
+            resume(c);
+        }
+        any = 1;
+    }
+    return any;
+}
+
+static void *park_main(void *arg) {
+    struct epoll_event events[PARK_EVENTS];
+    struct conn *wake[PARK_EVENTS];
+    int trim = 0;
+    (void) arg;
+
+    TRACE_THREAD("park", -1);
+    while (1) {
+        int n = epoll_wait(epoll_fd, events, PARK_EVENTS, trim ? TRIM_MS : -1);
+        int i, nwake = 0;
+
+        // threads that parked leave free chunks in their malloc arenas;
+        // hand the pages back once things have quietened down
+        if (n == 0) {
+            malloc_trim(0);
+            trim = 0;
+            continue;
+        }
+
+        // a connection's threads start only after the whole batch is seen,
+        // so no event left in it can point at a connection already freed
+        for (i = 0; i < n; i++) {
+            struct conn *c = (struct conn *) events[i].data.ptr;
+            if (c != NULL && unwatch(c)) {
+                wake[nwake++] = c;
+            }
+        }
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL && drain_arrivals()) {
+                trim = 1;
+            }
+        }
+        for (i = 0; i < nwake; i++) {
+            resume(wake[i]);
+        }
+    }
+    return NULL;
+}
+
+int park_start(size_t stack, void *(*entry)(void *), void (*drop)(struct conn *)) {
+    struct epoll_event ev;
+    pthread_t tid;
+
+    page_bytes = (size_t) sysconf(_SC_PAGESIZE);
+    stack_bytes = (stack + page_bytes - 1) / page_bytes * page_bytes;
+    pthread_attr_init(&spawn_attr);
+    resume_fn = entry;
+    drop_fn = drop;
+    mpsc_init(&arrivals);
+    mpsc_init(&exits);
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    arrive_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd == -1 || arrive_fd == -1) {
+        perror("epoll_create1");
+        return -1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, arrive_fd, &ev) == -1) {
+        perror("epoll_ctl");
+        return -1;
+    }
+
+    if (pthread_create(&tid, NULL, park_main, NULL) != 0) {
+        perror("pthread_create");
+        return -1;
+    }
+    pthread_detach(tid);
+    atomic_store(&running, 1);
+    return 0;
+}
+
+int park_running(void) {
+    return atomic_load(&running);
+}
+
+void park_conn(struct conn *c) {
+    uint64_t one = 1;
+    atomic_fetch_add(&parked, 1);
+    mpsc_push(&arrivals, &c->park_link);
+    if (write(arrive_fd, &one, sizeof(one)) == -1) {
+        perror("eventfd write");
+    }
+}
+
+int park_count(void) {
+    return atomic_load(&parked);
+}
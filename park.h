@@ -0,0 +1,34 @@
+#ifndef PARK_H
+#define PARK_H
+
+#include <stddef.h>
+
+struct conn;
+
+// idle connections kept without a thread. A client thread that has had
+// nothing to do for a while hands its connection to the park thread and
+// ends; once the socket or the wake descriptor turns readable, the park
+// thread starts a new client thread for it
+
+// start the park thread. From then on client threads are started with
+// park_spawn() on stacks of stack bytes that the park thread empties once
+// each thread is gone. Threads for woken connections run entry(conn), and
+// drop(conn) tears a connection down when no thread can be started for it
+// return 0 on success, -1 if the thread could not be started
+int park_start(size_t stack, void *(*entry)(void *), void (*drop)(struct conn *));
+
+// return 1 if the park thread is running
+int park_running(void);
+
+// start a client thread running fn(arg) to serve sock, from any thread
+// return 0 on success, -1 if it could not be started
+int park_spawn(void *(*fn)(void *), void *arg, int sock);
+
+// hand an idle connection over; the caller must not touch it again and
+// should end its thread. The connection must have no output held back
+void park_conn(struct conn *c);
+
+// connections currently parked
+int park_count(void);
+
+#endif
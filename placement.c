@@ -0,0 +1,151 @@
+#define _GNU_SOURCE              // CPU_SET, sched_getcpu, pthread_setaffinity_np
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include "placement.h"
+
+static unsigned char cpu_node[CPU_SETSIZE];   // node of each CPU, 0 if unknown
+static int cpu_list[CPU_SETSIZE];             // the configured CPUs, in order
+static int num_cpus = 0;                      // 0 leaves threads unpinned
+static cpu_set_t cpu_set;                     // the same CPUs as a mask
+static int num_workers = 0;
+static int steering = 0;
+
+// the nodeN entry in each CPU's sysfs directory names its node
+static void read_nodes(void) {
+    long n = sysconf(_SC_NPROCESSORS_CONF);
+    int cpu;
+
+    for (cpu = 0; cpu < n && cpu < CPU_SETSIZE; cpu++) {
+        char path[64];
+        struct dirent *e;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+        DIR *d = opendir(path);
+        if (!d) {
+            continue;
+        }
+        while ((e = readdir(d)) != NULL) {
+            int node;
+            if (sscanf(e->d_name, "node%d", &node) == 1) {
+                cpu_node[cpu] = (unsigned char) (node % PLACE_MAX_NODES);
+                break;
+            }
+        }
+        closedir(d);
+    }
+}
+
+// add one "a" or "a-b" entry of the list, return -1 if it is malformed
+// or names a CPU this process may not run on
+static int add_range(const char *s, const cpu_set_t *allowed) {
+    char *end;
+    long lo = strtol(s, &end, 10), hi = lo;
+
+    if (end == s) {
+        return -1;
+    }
+    if (*end == '-') {
+        const char *p = end + 1;
+        hi = strtol(p, &end, 10);
+        if (end == p) {
+            return -1;
+        }
+    }
+    if (*end != '\0' || lo < 0 || hi < lo || hi >= CPU_SETSIZE) {
+        return -1;
+    }
+    for (; lo <= hi; lo++) {
+        if (!CPU_ISSET(lo, allowed)) {
+            fprintf(stderr, "CPU %ld is not available\n", lo);
+            return -1;
+        }
+        if (!CPU_ISSET(lo, &cpu_set)) {
+            CPU_SET(lo, &cpu_set);
+            cpu_list[num_cpus++] = (int) lo;
+        }
+    }
+    return 0;
+}
+
+int placement_init(const char *cpus, int workers, int steer) {
+    cpu_set_t allowed;
+    char *copy, *tok, *save;
+
+    read_nodes();
+    CPU_ZERO(&cpu_set);
+    num_cpus = 0;
+    num_workers = workers;
+    steering = steer;
+    if (cpus == NULL || *cpus == '\0') {
+        return 0;
+    }
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        perror("sched_getaffinity");
+        return -1;
+    }
+    copy = strdup(cpus);
+    if (!copy) {
+        perror("strdup");
+        return -1;
+    }
+    for (tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+        if (add_range(tok, &allowed) == -1) {
+            free(copy);
+            num_cpus = 0;
+            return -1;
+        }
+    }
+    free(copy);
+    return num_cpus > 0 ? 0 : -1;
+}
+
+void place_thread(enum place_role role, int index) {
+    cpu_set_t set;
+    int slot = 0;
+
+    if (num_cpus == 0) {
+        return;
+    }
+    if (role == PLACE_WORKER) {
+        slot = 1 + index;
+    } else if (role == PLACE_ACTOR) {
+        slot = 1 + num_workers + index;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu_list[slot % num_cpus], &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        perror("pthread_setaffinity_np");
+    }
+}
+
+void place_client(pthread_attr_t *attr, int sock) {
+    cpu_set_t set = cpu_set;
+
+    if (num_cpus == 0) {
+        return;
+    }
+    if (steering) {
+        // the CPU that ran the receive path for this connection's packets
+        int cpu = -1;
+        socklen_t len = sizeof(cpu);
+        if (getsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 &&
+            cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &cpu_set)) {
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+        }
+    }
+    pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+int place_node(void) {
+    int cpu = sched_getcpu();
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        return 0;
+    }
+    return cpu_node[cpu];
+}
@@ -0,0 +1,32 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <pthread.h>
+
+#define PLACE_MAX_NODES 8        // NUMA nodes told apart; higher ones share a slot
+
+// threads that get a CPU of their own from the list, in this order
+enum place_role {
+    PLACE_REACTOR,               // the accept loop in main()
+    PLACE_WORKER,
+    PLACE_ACTOR,
+};
+
+// read the CPU to node map and parse cpus, a list such as "0-3,8"; NULL or
+// "" leaves threads unpinned. workers is the worker count, so actors start
+// after them in the list. steer pins each client thread to the CPU its
+// connection's packets arrive on, when that CPU is in the list
+// return 0 on success, -1 on a bad or offline CPU
+int placement_init(const char *cpus, int workers, int steer);
+
+// pin the calling thread to the list entry for its role and index
+void place_thread(enum place_role role, int index);
+
+// set attr for the thread about to serve sock: its incoming CPU when
+// steering, otherwise every CPU in the list; does nothing without a list
+void place_client(pthread_attr_t *attr, int sock);
+
+// slot of the NUMA node the calling thread is running on
+int place_node(void);
+
+#endif
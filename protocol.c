@@ -0,0 +1,296 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "protocol.h"
+#include "conn.h"
+#include "trace.h"
+
+void put_u32(char *p, uint32_t v) {
+    v = htonl(v);
+    memcpy(p, &v, 4);
+}
+
+uint32_t get_u32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return ntohl(v);
+}
+
+size_t bin_header(char *out, uint8_t op, size_t len) {
+    put_u32(out, (uint32_t)(len + 1));
+    out[4] = (char) op;
+    return BIN_HEADER;
+}
+
+size_t encode_reply(char *out, size_t max, int binary, int ok, uint8_t op, uint32_t id,
+                    const char *text) {
+    size_t off = binary ? BIN_HEADER + 5 : 0;
+    size_t tail = binary ? 0 : 6;
+    size_t len = strlen(text);
+
+    if (len > max - off - tail) {
+        len = max - off - tail;
+    }
+    memcpy(out + off, text, len);
+
+    if (binary) {
+        bin_header(out, ok ? OP_OK : OP_ERROR, 5 + len);
+        out[BIN_HEADER] = (char) op;
+        put_u32(out + BIN_HEADER + 1, id);
+    } else {
+        memcpy(out + len, "\nchat>", 6);
+    }
+    return off + len + tail;
+}
+
+long bin_parse(const char *buf, size_t avail, uint8_t *op, const char **payload, size_t *len) {
+    if (avail < 4) {
+        return 0;
+    }
+    // compared before adding the header, so a huge length cannot wrap
+    uint32_t n = get_u32(buf);
+    if (n < 1 || n > BIN_MAX_FRAME - 4) {
+        return -1;
+    }
+    if (avail < (size_t) n + 4) {
+        return 0;
+    }
+    *op = (uint8_t) buf[4];
+    *payload = buf + BIN_HEADER;
+    *len = n - 1;
+    return n + 4;
+}
+
+// shared by whole messages and relayed pieces; op is the binary event
+static struct chat_msg *chat_msg_build(uint32_t sender_id, const char *sender, const char *body,
+                                       size_t len, int first, int last, uint8_t op) {
+    // binary recipients get the body without the text client's line ending
+    size_t body_len = len;
+    while (last && body_len > 0 && (body[body_len - 1] == '\n' || body[body_len - 1] == '\r')) {
+        body_len--;
+    }
+
+    size_t name_len = first ? strlen(sender) : 0;
+    size_t head_len = first ? 3 + name_len + 2 : 0;     // "\n::" name "> "
+    size_t tail_len = last ? 6 : 0;                     // "\nchat>"
+    size_t text_len = head_len + len + tail_len;
+    size_t bin_len = BIN_HEADER + 4 + body_len;
+
+    struct chat_msg *m = (struct chat_msg *) malloc(sizeof(struct chat_msg) + text_len + bin_len);
+    if (!m) {
+        perror("malloc");
+        return NULL;
+    }
+    atomic_init(&m->refs, 1);
+    m->text = m->data;
+    m->bin = m->data + text_len;
+    m->text_len = text_len;
+    m->bin_len = bin_len;
+    m->claimed = NULL;
+    m->claimed_words = 0;
+
+    char *p = m->text;
+    if (first) {
+        memcpy(p, "\n::", 3);              p += 3;
+        memcpy(p, sender, name_len);       p += name_len;
+        memcpy(p, "> ", 2);                p += 2;
+    }
+    memcpy(p, body, len);                  p += len;
+    if (last) {
+        memcpy(p, "\nchat>", 6);
+    }
+
+    bin_header(m->bin, op, 4 + body_len);
+    put_u32(m->bin + BIN_HEADER, sender_id);
+    memcpy(m->bin + BIN_HEADER + 4, body, body_len);
+    return m;
+}
+
+struct chat_msg *chat_msg_new(uint32_t sender_id, const char *sender, const char *body, size_t len) {
+    return chat_msg_build(sender_id, sender, body, len, 1, 1, OP_MESSAGE);
+}
+
+struct chat_msg *chat_msg_piece(uint32_t sender_id, const char *sender, const char *body,
+                                size_t len, int first, int last) {
+    return chat_msg_build(sender_id, sender, body, len, first, last,
+                          last ? OP_MESSAGE : OP_MESSAGE_PART);
+}
+
+void chat_msg_get(struct chat_msg *m) {
+    atomic_fetch_add_explicit(&m->refs, 1, memory_order_relaxed);
+}
+
+void chat_msg_put(struct chat_msg *m) {
+    if (atomic_fetch_sub_explicit(&m->refs, 1, memory_order_acq_rel) == 1) {
+        free(m->claimed);
+        free(m);
+    }
+}
+
+int chat_msg_track(struct chat_msg *m, uint32_t ids) {
+    uint32_t words = (ids + 63) / 64;
+    m->claimed = (_Atomic(uint64_t) *) calloc(words ? words : 1, sizeof(uint64_t));
+    if (!m->claimed) {
+        perror("calloc");
+        return -1;
+    }
+    m->claimed_words = words;
+    return 0;
+}
+
+int chat_msg_claim(struct chat_msg *m, uint32_t id) {
+    if (!m->claimed || id / 64 >= m->claimed_words) {
+        return 1;
+    }
+    uint64_t bit = (uint64_t) 1 << (id % 64);
+    return !(atomic_fetch_or_explicit(&m->claimed[id / 64], bit, memory_order_relaxed) & bit);
+}
+
+static void chat_msg_release(void *arg) {
+    chat_msg_put((struct chat_msg *) arg);
+}
+
+void chat_msg_send(struct conn *to, struct chat_msg *m) {
+    chat_msg_get(m);
+    if (atomic_load(&to->binary)) {
+        conn_queue_ref(to, m->bin, m->bin_len, chat_msg_release, m);
+    } else {
+        conn_queue_ref(to, m->text, m->text_len, chat_msg_release, m);
+    }
+}
+
+struct relay *relay_new(uint32_t sender_id, const char *sender) {
+    struct relay *r = (struct relay *) calloc(1, sizeof(struct relay));
+    if (!r) {
+        perror("calloc");
+        return NULL;
+    }
+    r->sender_id = sender_id;
+    snprintf(r->sender, sizeof(r->sender), "%s", sender);
+    r->first = 1;
+    atomic_init(&r->busy, 0);
+    pthread_mutex_init(&r->lock, NULL);
+    return r;
+}
+
+void relay_add(struct relay *r, struct conn *c) {
+    pthread_mutex_lock(&r->lock);
+    if (r->count == r->cap) {
+        int newcap = r->cap ? r->cap * 2 : 16;
+        struct conn **grown = (struct conn **) realloc(r->to, newcap * sizeof(struct conn *));
+        if (!grown) {
+            perror("realloc");
+            pthread_mutex_unlock(&r->lock);
+            return;
+        }
+        r->to = grown;
+        r->cap = newcap;
+    }
+    conn_get(c);
+    r->to[r->count++] = c;
+    pthread_mutex_unlock(&r->lock);
+}
+
+static int conn_ptr_cmp(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t) *(struct conn * const *) a;
+    uintptr_t y = (uintptr_t) *(struct conn * const *) b;
+    return x < y ? -1 : x > y;
+}
+
+void relay_seal(struct relay *r, struct conn *from) {
+    int i, n = 0;
+
+    // a user reached through several rooms gets the message once
+    qsort(r->to, r->count, sizeof(struct conn *), conn_ptr_cmp);
+    for (i = 0; i < r->count; i++) {
+        if (r->to[i] == from || (n > 0 && r->to[n - 1] == r->to[i])) {
+            conn_put(r->to[i]);
+        } else {
+            r->to[n++] = r->to[i];
+        }
+    }
+    r->count = n;
+
+    // binary recipients first; a client only ever switches to binary, so
+    // the ones put last may have switched by the time the message ends
+    for (i = 0; i < r->count; i++) {
+        if (atomic_load(&r->to[i]->binary)) {
+            struct conn *c = r->to[i];
+            r->to[i] = r->to[r->streamed];
+            r->to[r->streamed++] = c;
+        }
+    }
+}
+
+// keep a piece for the text recipients, return -1 when out of memory
+static int relay_keep(struct relay *r, const char *body, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    char *grown = (char *) realloc(r->text, r->text_len + len);
+    if (!grown) {
+        perror("realloc");
+        return -1;
+    }
+    memcpy(grown + r->text_len, body, len);
+    r->text = grown;
+    r->text_len += len;
+    return 0;
+}
+
+void relay_send(struct relay *r, const char *body, size_t len, int last) {
+    int i;
+
+    // the text copy is bounded by the message size limit, not the room size
+    if (r->count > r->streamed && relay_keep(r, body, len) == 0 && last) {
+        struct chat_msg *m = chat_msg_new(r->sender_id, r->sender, r->text, r->text_len);
+        if (m) {
+            TRACE_BEGIN(TP_FANOUT);
+            for (i = r->streamed; i < r->count; i++) {
+                chat_msg_send(r->to[i], m);
+            }
+            TRACE_END(TP_FANOUT);
+            chat_msg_put(m);
+        }
+    }
+    if (r->streamed == 0) {
+        r->first = 0;
+        r->sent += len;
+        return;
+    }
+
+    // pieces are sent one at a time, so a relay holds at most one in memory
+    do {
+        size_t n = len > BIN_MAX_TEXT ? BIN_MAX_TEXT : len;
+        int end = last && n == len;
+        struct chat_msg *m = chat_msg_piece(r->sender_id, r->sender, body, n, r->first, end);
+        if (!m) {
+            return;
+        }
+
+        TRACE_BEGIN(TP_FANOUT);
+        for (i = 0; i < r->streamed; i++) {
+            chat_msg_send(r->to[i], m);
+        }
+        TRACE_END(TP_FANOUT);
+        chat_msg_put(m);
+
+        r->first = 0;
+        r->sent += n;
+        body += n;
+        len -= n;
+    } while (len > 0);
+}
+
+void relay_free(struct relay *r) {
+    int i;
+    for (i = 0; i < r->count; i++) {
+        conn_put(r->to[i]);
+    }
+    free(r->to);
+    free(r->text);
+    pthread_mutex_destroy(&r->lock);
+    free(r);
+}
@@ -0,0 +1,136 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+struct conn;
+
+/*
+ * Binary framing, negotiated by sending the text command "binary".
+ *
+ *   u32 length    bytes that follow, opcode included (network byte order)
+ *   u8  opcode
+ *   ... payload
+ *
+ * Rooms and users are named by the u32 ids the server hands out.
+ */
+
+#define BIN_MAX_FRAME 2048       // largest frame accepted, header included
+#define BIN_HEADER 5             // length + opcode
+
+// requests
+#define OP_LOGIN       0x01      // name
+#define OP_CREATE      0x02      // name
+#define OP_JOIN        0x03      // u32 room id
+#define OP_LEAVE       0x04      // u32 room id
+#define OP_USERS       0x05
+#define OP_ROOMS       0x06
+#define OP_CONNECT     0x07      // u32 user id
+#define OP_DISCONNECT  0x08      // u32 user id
+#define OP_MSG         0x09      // text
+#define OP_EXIT        0x0a
+#define OP_MSG_PART    0x0b      // text; more of the message follows, OP_MSG ends it
+#define OP_STATS       0x0c
+
+// replies and events
+#define OP_OK          0x80      // u8 request op, u32 id, text
+#define OP_ERROR       0x81      // u8 request op, u32 id, text
+#define OP_LIST        0x82      // u8 request op, then (u32 id, u8 len, name)*
+#define OP_MESSAGE     0x83      // u32 sender id, text
+#define OP_HELLO       0x84      // u32 own user id
+#define OP_MESSAGE_PART 0x85     // u32 sender id, text; OP_MESSAGE ends it
+#define OP_STORED      0x86      // u8 name length, sender name, text; sent while offline
+
+#define BIN_MAX_TEXT (BIN_MAX_FRAME - BIN_HEADER - 4)   // text in one MESSAGE frame
+
+void put_u32(char *p, uint32_t v);
+uint32_t get_u32(const char *p);
+
+// write the frame header for a payload of len bytes, return BIN_HEADER
+size_t bin_header(char *out, uint8_t op, size_t len);
+
+// encode a command reply: "<text>\nchat>" for text clients, an OK or ERROR
+// frame for binary ones; return its length, truncating text to fit max
+size_t encode_reply(char *out, size_t max, int binary, int ok, uint8_t op, uint32_t id,
+                    const char *text);
+
+// look for a complete frame at buf; return its total length, 0 if more
+// bytes are needed, or -1 if the length is invalid
+long bin_parse(const char *buf, size_t avail, uint8_t *op, const char **payload, size_t *len);
+
+// one chat message in both wire formats, shared by every recipient
+struct chat_msg {
+    atomic_int refs;
+    size_t text_len;
+    size_t bin_len;
+    char *text;                  // "\n::name> body\nchat>"
+    char *bin;                   // OP_MESSAGE frame
+    _Atomic(uint64_t) *claimed;  // one bit per recipient id sent to, NULL if not tracked
+    uint32_t claimed_words;
+    char data[];
+};
+
+// encode a message once for all recipients, holding one reference
+struct chat_msg *chat_msg_new(uint32_t sender_id, const char *sender, const char *body, size_t len);
+
+// encode one piece of a relayed message; the first piece carries the
+// sender's name for text clients and the last one ends the message
+// len is at most BIN_MAX_TEXT
+struct chat_msg *chat_msg_piece(uint32_t sender_id, const char *sender, const char *body,
+                                size_t len, int first, int last);
+void chat_msg_get(struct chat_msg *m);
+void chat_msg_put(struct chat_msg *m);
+
+// track recipients by user id below ids, for a message fanned out by several
+// threads at once; return -1 when out of memory, leaving it untracked
+int chat_msg_track(struct chat_msg *m, uint32_t ids);
+
+// return 1 the first time id is claimed, and always when not tracked
+int chat_msg_claim(struct chat_msg *m, uint32_t id);
+
+// send a message in the recipient's protocol; the queued output shares m
+// and holds a reference until it is written, or for a zero-copy send until
+// the kernel is done with it
+void chat_msg_send(struct conn *to, struct chat_msg *m);
+
+// a large message relayed piece by piece as it arrives. Its recipients are
+// fixed when it starts, and each holds a connection reference. Binary
+// recipients get each piece as a MESSAGE_PART frame, which names the sender,
+// so pieces of messages from several senders can be told apart. A text
+// client could not tell them apart, so text recipients get the message
+// whole once it ends, from one copy shared by all of them
+struct relay {
+    uint32_t sender_id;
+    char sender[32];
+    size_t sent;                 // body bytes relayed so far
+    int first;                   // no piece sent yet
+    int discarding;              // over the size limit, dropping the rest
+    atomic_int busy;             // a room was over its fan-out budget for a piece
+    pthread_mutex_t lock;        // recipients are added from several actors
+    int count, cap;
+    struct conn **to;
+    int streamed;                // to[0 .. streamed) are binary
+    char *text;                  // the body so far, for text recipients
+    size_t text_len;
+};
+
+struct relay *relay_new(uint32_t sender_id, const char *sender);
+
+// add a recipient, safe from any thread while the relay is being set up
+void relay_add(struct relay *r, struct conn *c);
+
+// drop duplicates and the sender once every recipient has been added, and
+// put the binary recipients first
+void relay_seal(struct relay *r, struct conn *from);
+
+// send one piece of the message to the binary recipients and keep it for
+// the text ones, who get the whole message with the last piece
+void relay_send(struct relay *r, const char *body, size_t len, int last);
+
+// drop the recipients' references and free the relay
+void relay_free(struct relay *r);
+
+#endif
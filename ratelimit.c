@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <netinet/in.h>
+#include "ratelimit.h"
+
+#define ADMIT_TABLE_SIZE 4096    // must be a power of two
+#define ADMIT_PROBE      8       // slots searched before evicting
+
+// one tracked source address
+struct admit_entry {
+    int used;
+    unsigned char addr[16];      // IPv4 addresses are stored v4-mapped
+    struct token_bucket tb;
+};
+
+// only touched from the accept thread, so no locking
+static struct admit_entry admit_table[ADMIT_TABLE_SIZE];
+
+static double elapsed(const struct timespec *from, const struct timespec *to) {
+    return (double)(to->tv_sec - from->tv_sec) +
+           (double)(to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static void tb_refill(struct token_bucket *tb, const struct timespec *now) {
+    double dt = elapsed(&tb->last, now);
+    if (dt > 0) {
+        tb->tokens += dt * tb->rate;
+        if (tb->tokens > tb->burst) {
+            tb->tokens = tb->burst;
+        }
+    }
+    tb->last = *now;
+}
+
+void tb_init(struct token_bucket *tb, double rate, double burst) {
+    tb->rate = rate;
+    tb->burst = burst;
+    tb->tokens = burst;
+    clock_gettime(CLOCK_MONOTONIC, &tb->last);
+}
+
+int tb_take(struct token_bucket *tb, double n) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    tb_refill(tb, &now);
+
+    if (tb->tokens < n) {
+        return 0;
+    }
+    tb->tokens -= n;
+    return 1;
+}
+
+double tb_wait(struct token_bucket *tb, double n) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    tb_refill(tb, &now);
+
+    // go into debt, so requests larger than the burst still make progress
+    tb->tokens -= n;
+    if (tb->tokens >= 0 || tb->rate <= 0) {
+        return 0;
+    }
+
+    double delay = -tb->tokens / tb->rate;
+    struct timespec ts;
+    ts.tv_sec = (time_t)delay;
+    ts.tv_nsec = (long)((delay - (double)ts.tv_sec) * 1e9);
+    while (nanosleep(&ts, &ts) == -1) {
+        // interrupted, sleep for the remainder
+    }
+    return delay;
+}
+
+////////////////////// ADMISSION HELPERS /////////////////////////
+
+// normalise an address into 16 bytes, return 0 if the family is not IP
+static int addr_key(const struct sockaddr_storage *addr, unsigned char key[16]) {
+    if (addr->ss_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+        memset(key, 0, 10);
+        key[10] = 0xff;
+        key[11] = 0xff;
+        memcpy(key + 12, &in->sin_addr, 4);
+        return 1;
+    }
+    if (addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+        memcpy(key, &in6->sin6_addr, 16);
+        return 1;
+    }
+    return 0;
+}
+
+// FNV-1a over the address bytes
+static uint32_t addr_hash(const unsigned char key[16]) {
+    uint32_t h = 2166136261u;
+    int i;
+    for (i = 0; i < 16; i++) {
+        h ^= key[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+int admit_address(const struct sockaddr_storage *addr, double rate, double burst) {
+    unsigned char key[16];
+    struct timespec now;
+    struct admit_entry *slot = NULL;
+    struct admit_entry *oldest = NULL;
+    int i;
+
+    if (rate <= 0 || !addr_key(addr, key)) {
+        return 1;   // limiting disabled, or not an IP peer
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint32_t h = addr_hash(key);
+
+    for (i = 0; i < ADMIT_PROBE; i++) {
+        struct admit_entry *e = &admit_table[(h + i) & (ADMIT_TABLE_SIZE - 1)];
+
+        if (e->used && memcmp(e->addr, key, 16) == 0) {
+            slot = e;
+            break;
+        }
+        // an unused entry, or one idle long enough to have refilled, is free
+        if (!e->used || elapsed(&e->tb.last, &now) * e->tb.rate >= e->tb.burst) {
+            if (slot == NULL || slot->used) {
+                slot = e;
+            }
+        } else if (oldest == NULL || elapsed(&e->tb.last, &oldest->tb.last) > 0) {
+            oldest = e;
+        }
+    }
+
+    if (slot == NULL) {
+        slot = oldest;   // table is hot: evict the least recently seen
+    }
+    if (!slot->used || memcmp(slot->addr, key, 16) != 0) {
+        slot->used = 1;
+        memcpy(slot->addr, key, 16);
+        tb_init(&slot->tb, rate, burst);
+    }
+
+    return tb_take(&slot->tb, 1);
+}
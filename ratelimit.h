@@ -0,0 +1,33 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <time.h>
+#include <sys/socket.h>
+
+// token bucket: refills at `rate` tokens per second, holds at most `burst`
+struct token_bucket {
+    double tokens;
+    double rate;
+    double burst;
+    struct timespec last;        // time of last refill
+};
+
+/////////////////// TOKEN BUCKET //////////////////////////
+
+// initialise a bucket, starting full
+void tb_init(struct token_bucket *tb, double rate, double burst);
+
+// take n tokens if available, return 1 on success and 0 otherwise
+int tb_take(struct token_bucket *tb, double n);
+
+// take n tokens, sleeping until the bucket has paid them back
+// return the number of seconds slept
+double tb_wait(struct token_bucket *tb, double n);
+
+/////////////////// ADMISSION CONTROL //////////////////////////
+
+// per-source-address connection rate limit, used by the accept thread only
+// return 1 if a new connection from addr may be admitted, 0 otherwise
+int admit_address(const struct sockaddr_storage *addr, double rate, double burst);
+
+#endif
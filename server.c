@@ -1,6 +1,7 @@
 #include "server.h"
 
 int chat_serv_sock_fd; // server socket
+int unix_serv_sock_fd = -1; // Unix domain server socket, if any
 
 /////////////////////////////////////////////
 // USE THESE LOCKS AND COUNTER TO SYNCHRONIZE
@@ -9,6 +10,7 @@ int numReaders = 0; // keep count of the number of readers
 
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;  // mutex lock
 pthread_mutex_t rw_lock = PTHREAD_MUTEX_INITIALIZER;  // read/write lock
+pthread_mutex_t fanout_lock = PTHREAD_MUTEX_INITIALIZER;  // room fan-out buckets, taken under a read lock
 
 /////////////////////////////////////////////
 
@@ -16,18 +18,53 @@ char const *server_MOTD = "Thanks for connecting to the BisonChat Server.\n\ncha
 
 struct node *head = NULL;
 
+struct server_config config = {
+    .backlog = BACKLOG,
+    .max_conns = MAX_CONNECTIONS,
+    .admit_rate = ADMIT_RATE,
+    .admit_burst = ADMIT_BURST,
+    .user_msg_rate = USER_MSG_RATE,
+    .user_byte_rate = USER_BYTE_RATE,
+    .room_fanout_rate = ROOM_FANOUT_RATE,
+    .stack_size = THREAD_STACK_KB * 1024,
+    .park_secs = PARK_SECS,
+    .workers = WORKERS,
+    .pool_fanout_min = POOL_FANOUT_MIN,
+    .actors = 0,
+    .coalesce_usec = 0,
+    .coalesce_bytes = COALESCE_BYTES,
+    .zerocopy_bytes = 0,
+    .max_message = MAX_MESSAGE,
+    .mailbox_bytes = MAILBOX_BYTES,
+    .offline_bytes = OFFLINE_BYTES,
+    .cpus = NULL,
+    .steer = 0,
+    .unix_path = NULL,
+    .trusted_uid = -1,
+};
+
+static pthread_attr_t client_thread_attr;   // detached, small stack
+
+atomic_int active_conns = 0;   // connections currently owned by a client thread
+
+static const char *BUSY_MSG = "Server busy, try again later.\n";
+
 // reader / writer lock helpers
 
 void start_read() {
+    TRACE_BEGIN(TP_READ_WAIT);
     pthread_mutex_lock(&mutex);
     numReaders++;
     if (numReaders == 1) {
         pthread_mutex_lock(&rw_lock);   // first reader locks writers out
     }
     pthread_mutex_unlock(&mutex);
+    TRACE_END(TP_READ_WAIT);
+    TRACE_BEGIN(TP_READ_HOLD);
 }
 
 void end_read() {
+    TRACE_END(TP_READ_HOLD);
     pthread_mutex_lock(&mutex);
     numReaders--;
     if (numReaders == 0) {
@@ -37,10 +74,14 @@ void end_read() {
 }
 
 void start_write() {
+    TRACE_BEGIN(TP_WRITE_WAIT);
     pthread_mutex_lock(&rw_lock);       // exclusive access
+    TRACE_END(TP_WRITE_WAIT);
+    TRACE_BEGIN(TP_WRITE_HOLD);
 }
 
 void end_write() {
+    TRACE_END(TP_WRITE_HOLD);
     pthread_mutex_unlock(&rw_lock);
 }
 
@@ -49,8 +90,8 @@ int get_server_socket() {
     int master_socket;
     struct sockaddr_in address; 
     
-    // create a master socket  
-    if ((master_socket = socket(AF_INET , SOCK_STREAM , 0)) == 0) {   
+    // create a non-blocking master socket so accepts can be batched
+    if ((master_socket = socket(AF_INET , SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC , 0)) < 0) {   
         perror("socket failed");   
         exit(EXIT_FAILURE);   
     }   
@@ -75,6 +116,56 @@ int get_server_socket() {
     return master_socket;
 }
 
+// listen on a filesystem path too, for clients on the same host
+int get_unix_socket(const char *path) {
+    struct sockaddr_un address;
+    struct stat st;
+    int sock;
+
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        printf("socket path too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket failed");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    // a socket left behind by an earlier run would fail the bind. Remove it
+    // only if nothing answers on it, and never remove anything else
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            printf("%s exists and is not a socket\n", path);
+            exit(EXIT_FAILURE);
+        }
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (probe < 0) {
+            perror("socket failed");
+            exit(EXIT_FAILURE);
+        }
+        if (connect(probe, (struct sockaddr *)&address, sizeof(address)) == 0) {
+            printf("a server is already listening on %s\n", path);
+            exit(EXIT_FAILURE);
+        }
+        if (errno != ECONNREFUSED) {
+            perror("connect to existing socket failed");
+            exit(EXIT_FAILURE);
+        }
+        close(probe);
+        unlink(path);
+    }
+    if (bind(sock, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror("bind failed");
+        exit(EXIT_FAILURE);
+    }
+
+    return sock;
+}
+
 int start_server(int serv_socket, int backlog) {
    int status = 0;
    if ((status = listen(serv_socket, backlog)) == -1) {
@@ -83,20 +174,201 @@ int start_server(int serv_socket, int backlog) {
    return status;
 }
 
-int accept_client(int serv_sock) {
+// accept one pending connection, return -1 with errno EAGAIN once drained
+int accept_client(int serv_sock, struct sockaddr_storage *client_addr) {
    int reply_sock_fd = -1;
    socklen_t sin_size = sizeof(struct sockaddr_storage);
-   struct sockaddr_storage client_addr;
 
-   if ((reply_sock_fd = accept(serv_sock,(struct sockaddr *)&client_addr, &sin_size)) == -1) {
-      printf("socket accept error\n");
+   if ((reply_sock_fd = accept4(serv_sock, (struct sockaddr *)client_addr, &sin_size,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+         printf("socket accept error\n");
+      }
    }
    return reply_sock_fd;
 }
 
+// turn a connection away before anything is allocated for it
+static void reject_client(int sock) {
+   send(sock, BUSY_MSG, strlen(BUSY_MSG), MSG_DONTWAIT | MSG_NOSIGNAL);
+   close(sock);
+}
+
+// hand an admitted connection to its own thread
+static void spawn_client(int sock) {
+   // client threads use blocking I/O; only the accept path needs O_NONBLOCK
+   int flags = fcntl(sock, F_GETFL);
+   fcntl(sock, F_SETFL, flags & ~O_NONBLOCK);
+
+   atomic_fetch_add(&active_conns, 1);
+
+   // the thread's stack and everything it allocates land on the node it runs on;
+   // when idle connections are parked, the park thread owns client stacks
+   if (park_running()) {
+      if (park_spawn(client_receive, (void *)(intptr_t)sock, sock) == -1) {
+         atomic_fetch_sub(&active_conns, 1);
+         close(sock);
+      }
+      return;
+   }
+   place_client(&client_thread_attr, sock);
+   pthread_t new_client_thread;
+   if (pthread_create(&new_client_thread, &client_thread_attr, client_receive, (void *)(intptr_t)sock) != 0) {
+      perror("pthread_create");
+      atomic_fetch_sub(&active_conns, 1);
+      close(sock);
+   }
+}
+
+static size_t client_stack_size(void) {
+   return config.stack_size < PTHREAD_STACK_MIN ? PTHREAD_STACK_MIN : config.stack_size;
+}
+
+// client threads are detached and run on a small stack
+static void init_thread_attr(void) {
+   size_t stack = client_stack_size();
+   pthread_attr_init(&client_thread_attr);
+   pthread_attr_setdetachstate(&client_thread_attr, PTHREAD_CREATE_DETACHED);
+   if (pthread_attr_setstacksize(&client_thread_attr, stack) != 0) {
+      printf("invalid stack size %zu, using the default\n", stack);
+   }
+}
+
+// drain the listen queue, up to ACCEPT_BATCH connections per wakeup
+static void accept_clients(int serv_sock) {
+   int n;
+   for (n = 0; n < ACCEPT_BATCH; n++) {
+      struct sockaddr_storage client_addr;
+      int new_client = accept_client(serv_sock, &client_addr);
+      if (new_client == -1) {
+         if (errno == EINTR || errno == ECONNABORTED) {
+            continue;
+         }
+         if (errno == EMFILE || errno == ENFILE) {
+            usleep(10000);   // out of descriptors, let connections drain
+         }
+         return;
+      }
+
+      // global ceiling first, it needs no lookup at all
+      if (atomic_load(&active_conns) >= config.max_conns ||
+          !admit_address(&client_addr, config.admit_rate, config.admit_burst)) {
+         reject_client(new_client);
+         continue;
+      }
+
+      spawn_client(new_client);
+   }
+}
+
+static void usage(const char *prog) {
+   fprintf(stderr,
+           "Usage: %s [-b backlog] [-m max_connections] [-r ip_rate] [-B ip_burst]\n"
+           "          [-u user_msg_rate] [-k user_byte_rate] [-f room_fanout_rate] [-s stack_kb]\n"
+           "          [-p park_secs] [-w workers] [-F pool_fanout_min] [-A room_actors]\n"
+           "          [-c coalesce_usec] [-C coalesce_bytes] [-z zerocopy_bytes]\n"
+           "          [-M max_message] [-o mailbox_bytes] [-O offline_bytes] [-G]\n"
+           "          [-P cpu_list] [-I] [-U socket_path] [-T trusted_uid]\n"
+           "  -b  listen backlog (default %d)\n"
+           "  -m  global connection ceiling (default %d)\n"
+           "  -r  new connections per second per source IP, 0 disables (default %.1f)\n"
+           "  -B  connection burst per source IP (default %.1f)\n"
+           "  -u  lines per second per user, 0 disables (default %.0f)\n"
+           "  -k  input bytes per second per user, 0 disables (default %.0f)\n"
+           "  -f  recipient sends per second per room, 0 disables (default %.0f)\n"
+           "  -s  client thread stack size in KB (default %d)\n"
+           "  -p  seconds a connection may idle before its thread is let go, 0 disables (default %d)\n"
+           "  -w  worker threads for listings and large broadcasts, 0 disables (default %d)\n"
+           "  -F  recipients at which a broadcast moves to the workers (default %d)\n"
+           "  -A  room actor threads; each room is owned by one of them, 0 disables (default 0)\n"
+           "  -c  hold output for up to this many microseconds to batch writes, 0 disables (default 0)\n"
+           "  -C  held-back bytes that are written without waiting (default %d)\n"
+           "  -z  send chat messages of at least this many bytes with MSG_ZEROCOPY, 0 disables (default 0)\n"
+           "  -M  largest chat message in bytes, at least %d (default %d)\n"
+           "  -o  DM bytes kept for each offline user, 0 disables (default %d)\n"
+           "  -O  DM bytes kept for all offline users together (default %d)\n"
+           "  -G  give TCP clients accounts too; anyone who logs in with a name\n"
+           "      gets its DM peers and mail (default Unix domain clients only)\n"
+           "  -P  pin the accept loop, workers and actors to these CPUs, e.g. 0-3,8\n"
+           "      (default unpinned); client threads run on the same CPUs\n"
+           "  -I  with -P, run each client thread on the CPU its packets arrive on\n"
+           "  -U  also listen on this Unix domain socket path (default off)\n"
+           "  -T  Unix domain clients with this uid skip flood control (default none)\n",
+           prog, BACKLOG, MAX_CONNECTIONS, ADMIT_RATE, ADMIT_BURST,
+           USER_MSG_RATE, USER_BYTE_RATE, ROOM_FANOUT_RATE, THREAD_STACK_KB, PARK_SECS,
+           WORKERS, POOL_FANOUT_MIN, COALESCE_BYTES, MAXBUFF, MAX_MESSAGE,
+           MAILBOX_BYTES, OFFLINE_BYTES);
+}
+
 int main(int argc, char **argv) {
+   int opt;
+
+   TRACE_THREAD("main", -1);
+   while ((opt = getopt(argc, argv, "b:m:r:B:u:k:f:s:p:w:F:A:c:C:z:M:o:O:GP:IU:T:h")) != -1) {
+      switch (opt) {
+      case 'b': config.backlog = atoi(optarg); break;
+      case 'm': config.max_conns = atoi(optarg); break;
+      case 'r': config.admit_rate = atof(optarg); break;
+      case 'B': config.admit_burst = atof(optarg); break;
+      case 'u': config.user_msg_rate = atof(optarg); break;
+      case 'k': config.user_byte_rate = atof(optarg); break;
+      case 'f': config.room_fanout_rate = atof(optarg); break;
+      case 's': config.stack_size = (size_t)atol(optarg) * 1024; break;
+      case 'p': config.park_secs = atol(optarg); break;
+      case 'w': config.workers = atoi(optarg); break;
+      case 'F': config.pool_fanout_min = atoi(optarg); break;
+      case 'A': config.actors = atoi(optarg); break;
+      case 'c': config.coalesce_usec = atol(optarg); break;
+      case 'C': config.coalesce_bytes = atol(optarg); break;
+      case 'z': config.zerocopy_bytes = atol(optarg); break;
+      case 'M': config.max_message = atol(optarg); break;
+      case 'o': config.mailbox_bytes = atol(optarg); break;
+      case 'O': config.offline_bytes = atol(optarg); break;
+      case 'G': config.open_accounts = 1; break;
+      case 'P': config.cpus = optarg; break;
+      case 'I': config.steer = 1; break;
+      case 'U': config.unix_path = optarg; break;
+      case 'T': config.trusted_uid = atol(optarg); break;
+      default:
+         usage(argv[0]);
+         exit(opt == 'h' ? 0 : 1);
+      }
+   }
+   if (config.backlog <= 0 || config.max_conns <= 0 || config.admit_burst < 1 ||
+       config.user_msg_rate < 0 || config.user_byte_rate < 0 || config.room_fanout_rate < 0 ||
+       config.park_secs < 0 || config.workers < 0 || config.pool_fanout_min < 1 || config.actors < 0 ||
+       config.coalesce_usec < 0 || config.coalesce_bytes < 1 || config.zerocopy_bytes < 0 ||
+       config.max_message < MAXBUFF || config.mailbox_bytes < 0 || config.offline_bytes < 0 ||
+       config.trusted_uid < -1) {
+      usage(argv[0]);
+      exit(1);
+   }
+   if (placement_init(config.cpus, config.workers, config.steer) == -1) {
+      printf("invalid CPU list %s\n", config.cpus);
+      exit(1);
+   }
+   place_thread(PLACE_REACTOR, 0);
+
+   init_thread_attr();
+   conn_coalesce(config.coalesce_usec, (size_t)config.coalesce_bytes);
+   conn_zerocopy((size_t)config.zerocopy_bytes);
+   offline_init((size_t)config.mailbox_bytes, (size_t)config.offline_bytes, config.open_accounts);
+
+   if (workpool_start(config.workers) == -1) {
+      printf("worker pool start error\n");
+      exit(1);
+   }
+   if (actors_start(config.actors) == -1) {
+      printf("room actor start error\n");
+      exit(1);
+   }
+   if (config.park_secs > 0 && park_start(client_stack_size(), client_resume, client_drop) == -1) {
+      printf("park thread start error\n");
+      exit(1);
+   }
 
    signal(SIGINT, sigintHandler);
+   signal(SIGPIPE, SIG_IGN);   // peers may vanish mid-send, handle EPIPE instead
     
    // create the default room
    start_write();
@@ -107,20 +379,39 @@ int main(int argc, char **argv) {
    chat_serv_sock_fd = get_server_socket();
 
    // get ready to accept connections
-   if (start_server(chat_serv_sock_fd, BACKLOG) == -1) {
+   if (start_server(chat_serv_sock_fd, config.backlog) == -1) {
       printf("start server error\n");
       exit(1);
    }
+   if (config.unix_path) {
+      unix_serv_sock_fd = get_unix_socket(config.unix_path);
+      if (start_server(unix_serv_sock_fd, config.backlog) == -1) {
+         printf("start server error\n");
+         exit(1);
+      }
+   }
    
    printf("Server Launched! Listening on PORT: %d\n", PORT);
+   if (config.unix_path) {
+      printf("Also listening on %s\n", config.unix_path);
+   }
     
-   // Main execution loop
+   // Main execution loop; both listeners feed the same client threads
    while (1) {
-      int new_client = accept_client(chat_serv_sock_fd);
-      if (new_client != -1) {
-         pthread_t new_client_thread;
-         pthread_create(&new_client_thread, NULL, client_receive, (void *)&new_client);
-         pthread_detach(new_client_thread);
+      struct pollfd pfd[2] = {
+         { .fd = chat_serv_sock_fd, .events = POLLIN },
+         { .fd = unix_serv_sock_fd, .events = POLLIN },   // ignored when -1
+      };
+      if (poll(pfd, 2, -1) == -1) {
+         if (errno == EINTR) continue;
+         perror("poll");
+         break;
+      }
+      if (pfd[0].revents) {
+         accept_clients(chat_serv_sock_fd);
+      }
+      if (pfd[1].revents) {
+         accept_clients(unix_serv_sock_fd);
       }
    }
 
@@ -153,8 +444,10 @@ void sigintHandler(int sig_num) {
        }
        struct room *rtmp = r;
        r = r->next;
+       free(rtmp->members);
        free(rtmp);
    }
+   intern_free(&room_ids);
 
    // free all users and their DM lists
    u = head;
@@ -169,9 +462,16 @@ void sigintHandler(int sig_num) {
        u = u->next;
        free(utmp);
    }
+   intern_free(&user_ids);
+   offline_free();
 
    end_write();
+   TRACE_DUMP();
 
    close(chat_serv_sock_fd);
+   if (unix_serv_sock_fd != -1) {
+      close(unix_serv_sock_fd);
+      unlink(config.unix_path);
+   }
    exit(0);
 }
@@ -1,6 +1,10 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE              // accept4, pthread_setaffinity_np
+#endif
+
 /* System Header Files */
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,6 +12,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
@@ -17,9 +22,24 @@
 #include <netdb.h>
 #include <ctype.h>
 #include <pthread.h>
+#include <poll.h>
+#include <limits.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
 
 /* Local Header Files */
 #include "list.h"
+#include "ratelimit.h"
+#include "bufpool.h"
+#include "conn.h"
+#include "workpool.h"
+#include "actor.h"
+#include "protocol.h"
+#include "offline.h"
+#include "park.h"
+#include "trace.h"
+#include "placement.h"
 
 #define MAX_READERS 25
 #define TRUE   1  
@@ -29,13 +49,63 @@
 #define max_clients  30
 #define DEFAULT_ROOM "Lobby"
 #define MAXBUFF   2096
-#define BACKLOG 2 
+#define SMALLBUFF 256            // short replies built on the stack
+#define CONN_BUF_CACHE 64        // free connection buffers kept for reuse
+#define THREAD_STACK_KB 64       // client thread stack size
+#define PARK_SECS 10             // idle seconds before a connection gives up its thread
+#define WORKERS 2                // command worker threads
+#define POOL_FANOUT_MIN 32       // broadcasts to this many recipients go to the pool
+#define LIST_PAGE 50             // entries per page of a users or rooms listing
+#define BACKLOG 128
+#define ACCEPT_BATCH 64          // max connections accepted per wakeup
+#define MAX_CONNECTIONS 1024     // global connection ceiling
+#define ADMIT_RATE 5.0           // new connections per second per source IP
+#define ADMIT_BURST 20.0         // connection burst allowed per source IP
+#define USER_MSG_RATE 20.0       // lines per second per user
+#define USER_BYTE_RATE 65536.0   // input bytes per second per user
+#define ROOM_FANOUT_RATE 20000.0 // recipient sends per second per room
+#define COALESCE_BYTES 16384     // held-back output that is written at once
+#define ZEROCOPY_SETTLE_MS 1000  // wait for zero-copy sends to finish when a client leaves
+#define MAX_MESSAGE 65536        // largest chat message, longer ones are cut
+#define MAILBOX_BYTES 16384      // offline messages kept per user
+#define OFFLINE_BYTES (16 << 20) // offline messages kept for all users
+
+// runtime configuration, filled from defaults and command line in main()
+struct server_config {
+    int backlog;
+    int max_conns;
+    double admit_rate;           // 0 disables per-IP admission control
+    double admit_burst;
+    double user_msg_rate;        // 0 disables; bursts are twice the rate
+    double user_byte_rate;
+    double room_fanout_rate;
+    size_t stack_size;           // bytes, for client threads
+    long park_secs;              // idle time before parking, 0 keeps a thread per connection
+    int workers;                 // 0 runs every command on the client thread
+    int pool_fanout_min;
+    int actors;                  // room owner threads, 0 keeps rooms under rw_lock
+    long coalesce_usec;          // egress coalescing window, 0 sends right away
+    long coalesce_bytes;
+    long zerocopy_bytes;         // smallest message sent with MSG_ZEROCOPY, 0 disables
+    long max_message;            // bytes, at least MAXBUFF
+    long mailbox_bytes;          // per user, 0 keeps no offline messages
+    long offline_bytes;
+    int open_accounts;           // TCP clients get accounts, claimed by name alone
+    const char *cpus;            // CPU list threads are pinned to, NULL leaves them unpinned
+    int steer;                   // pin each client thread to its connection's incoming CPU
+    const char *unix_path;       // Unix domain socket to listen on as well, or NULL
+    long trusted_uid;            // Unix peers with this uid skip flood control, -1 for none
+};
 
 // global variables provided in server.c
 extern int chat_serv_sock_fd;
+extern int unix_serv_sock_fd;
 extern int numReaders;
 extern pthread_mutex_t mutex;
 extern pthread_mutex_t rw_lock;
+extern pthread_mutex_t fanout_lock;
+extern struct server_config config;
+extern atomic_int active_conns;
 
 // global user list head (defined in server.c)
 extern struct node *head;
@@ -49,10 +119,13 @@ extern char const *server_MOTD;
 // prototypes
 
 int get_server_socket();
+int get_unix_socket(const char *path);
 int start_server(int serv_socket, int backlog);
-int accept_client(int serv_sock);
+int accept_client(int serv_sock, struct sockaddr_storage *client_addr);
 void sigintHandler(int sig_num);
 void *client_receive(void *ptr);
+void *client_resume(void *ptr);
+void client_drop(struct conn *conn);
 
 // reader / writer helpers
 void start_read();
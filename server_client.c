@@ -1,4 +1,6 @@
 #include "server.h"
+#include <stdarg.h>
+#include <malloc.h>
 
 // USE THESE LOCKS AND COUNTER TO SYNCHRONIZE
 extern int numReaders;
@@ -14,16 +16,33 @@ extern char const *server_MOTD;
  * Main thread for each client.
  */
 
+// per-connection working buffers, taken from the pool only while input is
+// being processed
+struct conn_buf {
+    char buffer[MAXBUFF];                    // data read
+    char line[MAXBUFF];                      // one text line, put together
+    char tmpbuf[MAXBUFF];                    // temp buffer
+    char cmd[MAXBUFF];
+    char *arguments[80];
+};
+
+// one pool per NUMA node, so a buffer is reused on the node that first touched it
+static struct buf_pool conn_buf_pools[PLACE_MAX_NODES] = {
+    [0 ... PLACE_MAX_NODES - 1] = BUF_POOL_INIT(sizeof(struct conn_buf), CONN_BUF_CACHE)
+};
+
 static const char *HELP_TEXT =
     "Commands:\n"
     "  login <username>    - login with username\n"
     "  create <room>       - create a room\n"
     "  join <room>         - join a room\n"
     "  leave <room>        - leave a room\n"
-    "  users               - list all users\n"
-    "  rooms               - list all rooms\n"
+    "  users [prefix] [page] - list users, optionally by prefix and page\n"
+    "  rooms [prefix] [page] - list rooms, optionally by prefix and page\n"
     "  connect <user>      - connect to user (DM)\n"
     "  disconnect <user>   - disconnect from user (DM)\n"
+    "  stats               - show server counters and memory use\n"
+    "  binary              - switch to binary framing (for bots)\n"
     "  exit / logout       - exit chat\n"
     "  help                - show this help\n";
 
@@ -44,375 +63,1500 @@ static char *trimwhitespace(char *str) {
 }
 
 // helper: send "Usage: ..." + prompt
-static void send_usage(int client, const char *usage) {
-    char buf[MAXBUFF];
+static void send_usage(struct conn *conn, const char *usage) {
+    char buf[SMALLBUFF];
     snprintf(buf, sizeof(buf), "Usage: %s\nchat>", usage);
-    send(client, buf, strlen(buf), 0);
-}
-
-// helper: send error/info message + prompt
-static void send_error(int client, const char *msg) {
-    char buf[MAXBUFF];
-    snprintf(buf, sizeof(buf), "%s\nchat>", msg);
-    send(client, buf, strlen(buf), 0);
+    conn_send(conn, buf, strlen(buf));
 }
 
 // helper: send just "chat>" prompt
-static void send_prompt(int client) {
+static void send_prompt(struct conn *conn) {
     const char *p = "chat>";
-    send(client, p, strlen(p), 0);
+    conn_send(conn, p, strlen(p));
 }
 
-// helper to see if a user is already in recipient list
-static int in_recipient_list(struct node *list[], int count, struct node *u) {
-    int i;
-    for (i = 0; i < count; i++) {
-        if (list[i] == u) return 1;
+// helper to append a recipient id, growing the list as needed
+static void add_recipient(uint32_t **list, int *count, int *cap, uint32_t id) {
+    if (*count == *cap) {
+        int newcap = *cap ? *cap * 2 : 16;
+        uint32_t *grown = (uint32_t *) realloc(*list, newcap * sizeof(uint32_t));
+        if (!grown) {
+            perror("realloc");
+            return;
+        }
+        *list = grown;
+        *cap = newcap;
+    }
+    (*list)[(*count)++] = id;
+}
+
+// charge n recipient sends to a room's fan-out budget, return 1 if allowed
+static int take_fanout(struct room *r, int n) {
+    int ok;
+
+    if (config.room_fanout_rate <= 0 || n <= 0) {
+        return 1;
+    }
+
+    pthread_mutex_lock(&fanout_lock);
+    if (r->fanout.burst == 0) {
+        tb_init(&r->fanout, config.room_fanout_rate, 2 * config.room_fanout_rate);
+    }
+    ok = tb_take(&r->fanout, n);
+    pthread_mutex_unlock(&fanout_lock);
+
+    return ok;
+}
+
+// delay this client's next read until it is back within its budgets,
+// so a flooding client is held back by TCP flow control
+static void throttle_input(struct node *me, int bytes) {
+    if (me->trusted) {
+        return;
+    }
+    if (config.user_msg_rate > 0) {
+        tb_wait(&me->msg_tb, 1);
+    }
+    if (config.user_byte_rate > 0) {
+        tb_wait(&me->byte_tb, bytes);
     }
-    return 0;
 }
 
 // helper to build recipient list based on rooms and DMs
-static int build_recipients(struct node *sender, struct node *recipients[], int max_recips) {
-    int count = 0;
+// *recipients holds user ids, is allocated here and must be freed by the caller
+// rooms over their fan-out budget are skipped and counted in *throttled
+static int build_recipients(struct node *sender, uint32_t **recipients, int *throttled) {
+    int count = 0, cap = 0;
+
+    *recipients = NULL;
+    *throttled = 0;
 
     if (!sender) {
         return 0;
     }
+    TRACE_BEGIN(TP_RECIPIENTS);
+
+    // one bit per user id, so duplicates across rooms and DMs are dropped in O(1)
+    uint32_t words = (intern_limit(&user_ids) + 63) / 64;
+    uint64_t *seen = (uint64_t *) calloc(words ? words : 1, sizeof(uint64_t));
+    if (!seen) {
+        perror("calloc");
+        TRACE_END(TP_RECIPIENTS);
+        return 0;
+    }
+    seen[sender->id / 64] |= (uint64_t) 1 << (sender->id % 64);
 
-    // all users who share a room with sender
-    struct room *r = room_head;
-    while (r != NULL) {
-        int sender_in_room = 0;
-        struct room_user *ru = r->users;
+    // all users who share a room with sender; in actor mode the room owners
+    // do this part themselves
+    struct room *r = actors_running() ? NULL : room_head;
+    for (; r != NULL; r = r->next) {
+        if (!inRoom(r, sender)) {
+            continue;
+        }
+        if (!take_fanout(r, r->member_count - 1)) {
+            (*throttled)++;
+            continue;
+        }
 
-        while (ru != NULL) {
-            if (ru->user == sender) {
-                sender_in_room = 1;
-                break;
+        uint32_t w;
+        uint32_t n = r->member_words < words ? r->member_words : words;
+        for (w = 0; w < n; w++) {
+            uint64_t fresh = r->members[w] & ~seen[w];
+            seen[w] |= fresh;
+            while (fresh) {
+                add_recipient(recipients, &count, &cap, w * 64 + __builtin_ctzll(fresh));
+                fresh &= fresh - 1;
             }
-            ru = ru->next;
         }
+    }
 
-        if (sender_in_room) {
-            ru = r->users;
-            while (ru != NULL) {
-                if (ru->user != sender &&
-                    !in_recipient_list(recipients, count, ru->user)) {
-                    if (count < max_recips) {
-                        recipients[count++] = ru->user;
-                    }
-                }
-                ru = ru->next;
+    // all DM peers
+    struct dm_conn *d;
+    for (d = sender->dm_head; d != NULL; d = d->next) {
+        if (!bitmap_test(seen, words, d->peer->id)) {
+            seen[d->peer->id / 64] |= (uint64_t) 1 << (d->peer->id % 64);
+            add_recipient(recipients, &count, &cap, d->peer->id);
+        }
+    }
+
+    free(seen);
+    TRACE_END(TP_RECIPIENTS);
+    return count;
+}
+
+// uid of a Unix domain peer from SO_PEERCRED, -1 for any other socket
+static long peer_uid(int sock) {
+    struct sockaddr_storage local;
+    socklen_t len = sizeof(local);
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+
+    if (getsockname(sock, (struct sockaddr *)&local, &len) == -1 || local.ss_family != AF_UNIX) {
+        return -1;
+    }
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1) {
+        perror("SO_PEERCRED");
+        return -1;
+    }
+    int trusted = config.trusted_uid >= 0 && cred.uid == (uid_t) config.trusted_uid;
+    printf("local client pid %d uid %d%s\n", (int) cred.pid, (int) cred.uid,
+           trusted ? ", trusted" : "");
+    return (long) cred.uid;
+}
+
+////////////////////// REPLIES /////////////////////////
+
+// what a command handler needs to know about the client it runs for
+struct session {
+    int client;
+    struct conn *conn;
+    struct node *me;
+    struct conn_buf *cb;         // scratch space for this input
+};
+
+// reply in the client's protocol, see encode_reply()
+static void reply(struct session *s, int ok, uint8_t op, uint32_t id, const char *fmt, ...) {
+    char text[SMALLBUFF], buf[SMALLBUFF + BIN_HEADER + 6];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(text, sizeof(text), fmt, ap);
+    va_end(ap);
+
+    size_t len = encode_reply(buf, sizeof(buf), atomic_load(&s->conn->binary), ok, op, id, text);
+    conn_send(s->conn, buf, len);
+}
+
+// append one (id, name) entry to a binary listing, return 0 when full
+static int add_list_entry(char *buf, size_t *off, size_t max, uint32_t id, const char *name) {
+    size_t len = strlen(name);
+    if (*off + 5 + len > max) {
+        return 0;
+    }
+    put_u32(buf + *off, id);
+    buf[*off + 4] = (char) len;
+    memcpy(buf + *off + 5, name, len);
+    *off += 5 + len;
+    return 1;
+}
+
+// a users or rooms listing, sent a chunk at a time in name order
+struct listing {
+    int rooms;                   // 1 for rooms, 0 for users
+    int binary;
+    uint32_t page;               // 1-based, 0 for every match
+    char prefix[32];
+    char last[32];               // last name sent, the next chunk resumes after it
+    uint32_t left;               // entries still to send
+    int started;
+    int done;
+};
+
+static void listing_init(struct listing *l, int binary, int rooms, const char *prefix, uint32_t page) {
+    memset(l, 0, sizeof(*l));
+    l->binary = binary;
+    l->rooms = rooms;
+    l->page = page;
+    snprintf(l->prefix, sizeof(l->prefix), "%s", prefix ? prefix : "");
+    l->left = page ? LIST_PAGE : UINT32_MAX;
+}
+
+// build the next chunk of a listing in the client's protocol
+// called with the read lock held, return its length and set l->done after the last
+static size_t listing_chunk(struct listing *l, char *buf, size_t max) {
+    struct intern_table *t = l->rooms ? &room_ids : &user_ids;
+    uint32_t lo = intern_seek(t, l->prefix, 0);
+    uint32_t hi = intern_prefix_end(t, l->prefix, lo);
+    uint32_t pos;
+    size_t off;
+
+    if (l->binary) {
+        if (max > BIN_MAX_FRAME) max = BIN_MAX_FRAME;
+        off = BIN_HEADER + 2;
+    } else {
+        max -= 6;   // room for the closing prompt
+        off = 0;
+    }
+
+    if (!l->started) {
+        // a page past the end lists nothing; checked first, so a huge page
+        // number cannot wrap the position back into the table
+        pos = lo;
+        if (l->page) {
+            pos = l->page - 1 <= (hi - lo) / LIST_PAGE ? lo + (l->page - 1) * LIST_PAGE : hi;
+        }
+        if (!l->binary) {
+            const char *title = l->rooms ? "Rooms" : "Users";
+            if (l->page) {
+                uint32_t pages = hi > lo ? (hi - lo + LIST_PAGE - 1) / LIST_PAGE : 1;
+                off = snprintf(buf, max, "%s (page %u of %u):\n", title, l->page, pages);
+            } else {
+                off = snprintf(buf, max, "%s:\n", title);
             }
         }
+        l->started = 1;
+    } else {
+        // resume by name, so users coming and going between chunks do not
+        // make us skip or repeat anyone
+        pos = intern_seek(t, l->last, 1);
+    }
 
-        r = r->next;
+    for (; pos < hi && l->left > 0; pos++, l->left--) {
+        uint32_t id = intern_at(t, pos);
+        void *obj = intern_get(t, id);
+        const char *name = l->rooms ? ((struct room *) obj)->name : ((struct node *) obj)->username;
+        size_t len = strlen(name);
+
+        if (l->binary) {
+            if (!add_list_entry(buf, &off, max, id, name)) break;
+        } else {
+            if (off + len + 3 > max) break;
+            memcpy(buf + off, "  ", 2);
+            memcpy(buf + off + 2, name, len);
+            buf[off + len + 2] = '\n';
+            off += len + 3;
+        }
+        memcpy(l->last, name, len + 1);
     }
+    l->done = pos >= hi || l->left == 0;
 
-    // all DM peers
-    struct dm_conn *d = sender->dm_head;
-    while (d != NULL) {
-        if (d->peer != sender &&
-            !in_recipient_list(recipients, count, d->peer)) {
-            if (count < max_recips) {
-                recipients[count++] = d->peer;
+    if (l->binary) {
+        bin_header(buf, OP_LIST, off - BIN_HEADER);
+        buf[BIN_HEADER] = l->rooms ? OP_ROOMS : OP_USERS;
+        buf[BIN_HEADER + 1] = !l->done;
+    } else if (l->done) {
+        memcpy(buf + off, "chat>", 5);
+        off += 5;
+    }
+    return off;
+}
+
+// send a whole listing, taking the read lock once per chunk so it is never
+// held across a send; workers queue the chunks for the client thread instead
+static void send_listing(struct conn *conn, struct listing *l, char *buf, int owner) {
+    do {
+        start_read();
+        size_t len = listing_chunk(l, buf, MAXBUFF);
+        end_read();
+
+        if (owner) {
+            conn_send(conn, buf, len);
+        } else if (conn_queue(conn, buf, len) != 0) {
+            break;
+        }
+    } while (!l->done);
+}
+
+////////////////////// WORKER JOBS /////////////////////////
+
+// a connection's jobs finish before its next command runs, so its replies
+// and its messages go out in the order its commands came in
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_done = PTHREAD_COND_INITIALIZER;
+
+// a job submitted for conn has finished
+static void job_finished(struct conn *conn) {
+    pthread_mutex_lock(&jobs_lock);
+    if (atomic_fetch_sub(&conn->jobs, 1) == 1) {
+        pthread_cond_broadcast(&jobs_done);
+    }
+    pthread_mutex_unlock(&jobs_lock);
+}
+
+// owner thread only: wait for the connection's jobs, before a command
+static void wait_jobs(struct conn *conn) {
+    if (atomic_load(&conn->jobs) == 0) {
+        return;
+    }
+    pthread_mutex_lock(&jobs_lock);
+    while (atomic_load(&conn->jobs) > 0) {
+        pthread_cond_wait(&jobs_done, &jobs_lock);
+    }
+    pthread_mutex_unlock(&jobs_lock);
+}
+
+// a users/rooms listing, built on a worker and queued back to the client
+struct list_job {
+    struct conn *conn;
+    struct listing list;
+};
+
+// a message fanned out on a worker, holding a reference to each recipient
+struct broadcast_job {
+    struct conn *from;           // the sender, holding a reference
+    struct chat_msg *msg;
+    int count;
+    struct conn *to[];
+};
+
+static void run_list_job(void *arg) {
+    struct list_job *job = (struct list_job *) arg;
+    char *buf = (char *) malloc(MAXBUFF);
+
+    if (buf) {
+        send_listing(job->conn, &job->list, buf, 0);
+        free(buf);
+    }
+
+    job_finished(job->conn);
+    conn_put(job->conn);
+    free(job);
+}
+
+static void run_broadcast_job(void *arg) {
+    struct broadcast_job *job = (struct broadcast_job *) arg;
+    int k;
+
+    TRACE_BEGIN(TP_FANOUT);
+    for (k = 0; k < job->count; k++) {
+        chat_msg_send(job->to[k], job->msg);
+        conn_put(job->to[k]);
+    }
+    TRACE_END(TP_FANOUT);
+    chat_msg_put(job->msg);
+    job_finished(job->from);
+    conn_put(job->from);
+    free(job);
+}
+
+// hand a listing to the worker pool, return -1 to run it here instead
+static int submit_list(struct conn *conn, const struct listing *l) {
+    struct list_job *job = (struct list_job *) malloc(sizeof(struct list_job));
+    if (!job) {
+        return -1;
+    }
+    conn_get(conn);
+    job->conn = conn;
+    job->list = *l;
+
+    atomic_fetch_add(&conn->jobs, 1);
+    if (workpool_submit(run_list_job, job) == -1) {
+        atomic_fetch_sub(&conn->jobs, 1);
+        conn_put(conn);
+        free(job);
+        return -1;
+    }
+    return 0;
+}
+
+// hand a fan-out to the worker pool, return -1 to send it here instead
+// called with the read lock held so the recipients cannot go away
+static int submit_broadcast(struct conn *from, uint32_t recipients[], int rc, struct chat_msg *msg) {
+    struct broadcast_job *job = (struct broadcast_job *)
+        malloc(sizeof(struct broadcast_job) + rc * sizeof(struct conn *));
+    if (!job) {
+        return -1;
+    }
+    chat_msg_get(msg);
+    conn_get(from);
+    job->from = from;
+    job->msg = msg;
+    job->count = 0;
+
+    int k;
+    for (k = 0; k < rc; k++) {
+        struct node *u = findUById(head, recipients[k]);
+        if (u && u->conn && chat_msg_claim(msg, u->id)) {
+            conn_get(u->conn);
+            job->to[job->count++] = u->conn;
+        }
+    }
+
+    atomic_fetch_add(&from->jobs, 1);
+    if (workpool_submit(run_broadcast_job, job) == -1) {
+        atomic_fetch_sub(&from->jobs, 1);
+        for (k = 0; k < job->count; k++) {
+            conn_put(job->to[k]);
+        }
+        conn_put(from);
+        chat_msg_put(msg);
+        free(job);
+        return -1;
+    }
+    return 0;
+}
+
+////////////////////// ACTOR MODE /////////////////////////
+
+// remember a joined room, return 1 if it was not joined before
+static int track_room(struct node *me, struct room *r) {
+    struct room_ref *ref;
+    for (ref = me->joined; ref != NULL; ref = ref->next) {
+        if (ref->room == r) return 0;
+    }
+    ref = (struct room_ref *) malloc(sizeof(struct room_ref));
+    if (!ref) {
+        perror("malloc");
+        return 0;
+    }
+    ref->room = r;
+    ref->next = me->joined;
+    me->joined = ref;
+    return 1;
+}
+
+// forget a joined room, return 1 if it was joined
+static int untrack_room(struct node *me, struct room *r) {
+    struct room_ref *ref = me->joined, *prev = NULL;
+    while (ref != NULL) {
+        if (ref->room == r) {
+            if (prev == NULL) {
+                me->joined = ref->next;
+            } else {
+                prev->next = ref->next;
             }
+            free(ref);
+            return 1;
         }
-        d = d->next;
+        prev = ref;
+        ref = ref->next;
     }
+    return 0;
+}
 
-    return count;
+// leave every joined room; called with the write lock held
+static void leave_all_rooms(struct node *me) {
+    while (me->joined != NULL) {
+        struct room_ref *ref = me->joined;
+        me->joined = ref->next;
+        actor_post_leave(ref->room, me, &me->room_ops);
+        free(ref);
+    }
+}
+
+// the user served on conn, NULL if it is gone; ids are reused, so the
+// user found must still be this connection's. Called with the lock held
+static struct node *conn_user(struct conn *conn) {
+    struct node *me = findUById(head, conn->user_id);
+    return me && me->conn == conn ? me : NULL;
 }
 
 // cleanup user from all structures when disconnecting
-static void cleanup_client_user(int client) {
+static void cleanup_client_user(struct conn *conn) {
+    TRACE_BEGIN(TP_CLEANUP);
+    if (actors_running()) {
+        start_write();
+        struct node *me = conn_user(conn);
+        if (me) {
+            leave_all_rooms(me);
+        }
+        end_write();
+
+        // wait until the owners have applied every join and leave posted for
+        // the user, including leaves posted earlier by cmd_leave; after that
+        // nothing outside the user list points at it
+        if (me) {
+            actor_sync_wait(&me->room_ops);
+        }
+    }
+
     start_write();
-    struct node *me = findUBySocket(head, client);
+    struct node *me = conn_user(conn);
 
     if (me) {
         // remove from all rooms
-        struct room *r = room_head;
+        struct room *r = actors_running() ? NULL : room_head;
         while (r != NULL) {
             removeUserFromRoom(r, me);
             r = r->next;
         }
 
-        // remove all DMs (this also updates peers)
+        // remove all DMs (this also updates peers); logged-in users keep
+        // them on their account until they come back
         while (me->dm_head != NULL) {
             struct node *peer = me->dm_head->peer;
             removeDM(me, peer);
         }
+        if (me->acct) {
+            account_logout(me->acct);
+        }
 
         // remove from global user list
-        struct node *cur = head;
-        struct node *prev = NULL;
-        while (cur != NULL) {
-            if (cur == me) {
-                if (prev == NULL) {
-                    head = cur->next;
-                } else {
-                    prev->next = cur->next;
-                }
-                free(cur);
-                break;
-            }
-            prev = cur;
-            cur = cur->next;
-        }
+        head = removeU(head, me);
     }
     end_write();
+    TRACE_END(TP_CLEANUP);
 }
 
-void *client_receive(void *ptr) {
-    int client = *(int *) ptr;  // socket
-  
-    int received, i;
-    char buffer[MAXBUFF], sbuffer[MAXBUFF];  // data buffer  
-    char tmpbuf[MAXBUFF];                    // temp buffer  
-    char cmd[MAXBUFF], username[20];
-    char *arguments[80];
+// close the connection; the descriptor itself is closed once workers drop
+// their references
+static void finish_client(int client, struct conn *conn) {
+    shutdown(client, SHUT_RDWR);
+    if (conn) {
+        conn_put(conn);
+    } else {
+        close(client);
+    }
+    atomic_fetch_sub(&active_conns, 1);
+}
 
-    struct node *currentUser;
-    
-    send(client, server_MOTD, strlen(server_MOTD), 0); // Send MOTD
+////////////////////// COMMANDS /////////////////////////
+// shared by the text and binary protocols; names are resolved by the caller
 
-    // Creating the guest user name
-    snprintf(username, sizeof(username), "guest%d", client);
+static void cmd_create(struct session *s, char *name) {
+    TRACE_BEGIN(TP_CMD_CREATE);
+    printf("create room: %s\n", name);
 
-    // add user and put into Lobby
     start_write();
-    head = insertFirstU(head, client, username);
-    struct node *me_init = findUBySocket(head, client);
+    struct room *r = createRoom(name);
+    uint32_t id = r ? r->id : 0;
+    end_write();
 
-    struct room *lobby = createRoom(DEFAULT_ROOM);
-    if (lobby && me_init) {
-        addUserToRoom(lobby, me_init);
+    reply(s, r != NULL, OP_CREATE, id, "Room %s created (or already exists)", name);
+    TRACE_END(TP_CMD_CREATE);
+}
+
+static void cmd_join(struct session *s, char *name) {
+    struct node *me = s->me;
+
+    TRACE_BEGIN(TP_CMD_JOIN);
+    printf("join room: %s\n", name);
+
+    start_write();
+    struct room *r = findRoom(name);
+    if (!r) {
+        r = createRoom(name);
+    }
+    if (r && !actors_running()) {
+        addUserToRoom(r, me);
+    } else if (r && track_room(me, r)) {
+        actor_post_join(r, me, &me->room_ops);
     }
+    uint32_t id = r ? r->id : 0;
     end_write();
-   
-    while (1) {
-        received = read(client, buffer, MAXBUFF - 1);
-        if (received > 0) {
-            buffer[received] = '\0'; 
-            strcpy(cmd, buffer);  
-            strcpy(sbuffer, buffer);
 
-            // cache current user for this iteration
-            start_read();
-            struct node *me = findUBySocket(head, client);
-            end_read();
+    reply(s, r != NULL, OP_JOIN, id, "Joined room %s", name);
+    TRACE_END(TP_CMD_JOIN);
+}
 
-            if (!me) {
-                // user missing from list, clean up and exit
-                close(client);
-                pthread_exit(NULL);
-            }
-         
-            // tokenize input
-            arguments[0] = strtok(cmd, delimiters);
-            i = 0;
-            while (arguments[i] != NULL) {
-                arguments[i] = trimwhitespace(arguments[i]);
-                i++;
-                arguments[i] = strtok(NULL, delimiters); 
-            }
+static void cmd_leave(struct session *s, char *name) {
+    struct node *me = s->me;
+    uint32_t id = 0;
 
-            if (arguments[0] == NULL) {
-                send_prompt(client);
-                continue;
-            }
+    TRACE_BEGIN(TP_CMD_LEAVE);
+    printf("leave room: %s\n", name);
+
+    start_write();
+    struct room *r = findRoom(name);
+    if (r) {
+        id = r->id;
+    }
+    if (r && actors_running()) {
+        // the owner deletes the room once it is empty
+        if (untrack_room(me, r)) {
+            actor_post_leave(r, me, &me->room_ops);
+        }
+    } else if (r) {
+        removeUserFromRoom(r, me);
+        deleteEmptyRooms(DEFAULT_ROOM);
+    }
+    end_write();
 
-            // Execute command
+    if (r) {
+        reply(s, 1, OP_LEAVE, id, "Left room %s", name);
+    } else {
+        reply(s, 0, OP_LEAVE, id, "Room %s does not exist", name);
+    }
+    TRACE_END(TP_CMD_LEAVE);
+}
 
-            if (strcmp(arguments[0], "create") == 0) {
-                if (arguments[1] == NULL) {
-                    send_usage(client, "create <room>");
-                    continue;
-                }
+static void cmd_connect(struct session *s, char *name) {
+    struct node *me = s->me;
+    int self = 0;
+    uint32_t id = 0;
 
-                printf("create room: %s\n", arguments[1]); 
-              
-                start_write();
-                createRoom(arguments[1]);
-                end_write();
-              
-                snprintf(buffer, sizeof(buffer), "Room %s created (or already exists)\nchat>", arguments[1]);
-                send(client, buffer, strlen(buffer), 0);
+    TRACE_BEGIN(TP_CMD_CONNECT);
+    printf("connect to user: %s \n", name);
+
+    start_write();
+    struct node *peer = findU(head, name);
+    if (peer) {
+        id = peer->id;
+        if (me == peer) {
+            self = 1;
+        } else {
+            addDM(me, peer);
+            if (me->acct && peer->acct) {
+                account_link(me->acct, peer->acct);
             }
-            else if (strcmp(arguments[0], "join") == 0) {
-                if (arguments[1] == NULL) {
-                    send_usage(client, "join <room>");
-                    continue;
-                }
+        }
+    }
+    end_write();
 
-                printf("join room: %s\n", arguments[1]);  
+    if (!peer) {
+        reply(s, 0, OP_CONNECT, id, "User %s not found", name);
+    } else if (self) {
+        reply(s, 0, OP_CONNECT, id, "Cannot connect to yourself");
+    } else {
+        reply(s, 1, OP_CONNECT, id, "Connected to %s", name);
+    }
+    TRACE_END(TP_CMD_CONNECT);
+}
 
-                start_write();
-                struct room *r = findRoom(arguments[1]);
-                if (!r) {
-                    r = createRoom(arguments[1]);
-                }
-                if (r) {
-                    addUserToRoom(r, me);
+static void cmd_disconnect(struct session *s, char *name) {
+    uint32_t id = 0;
+
+    TRACE_BEGIN(TP_CMD_DISCONNECT);
+    printf("disconnect from user: %s\n", name);
+
+    start_write();
+    struct node *peer = findU(head, name);
+    if (peer) {
+        id = peer->id;
+        removeDM(s->me, peer);
+        if (s->me->acct && peer->acct) {
+            account_unlink(s->me->acct, peer->acct);
+        }
+    }
+    end_write();
+
+    if (peer) {
+        reply(s, 1, OP_DISCONNECT, id, "Disconnected from %s", name);
+    } else {
+        reply(s, 0, OP_DISCONNECT, id, "User %s not found", name);
+    }
+    TRACE_END(TP_CMD_DISCONNECT);
+}
+
+// prefix may be NULL; page is 1-based, 0 sends every match
+static void cmd_list(struct session *s, int rooms, const char *prefix, uint32_t page) {
+    struct listing l;
+
+    TRACE_BEGIN(TP_CMD_LIST);
+    printf(rooms ? "List all the rooms\n" : "List all the users\n");
+    listing_init(&l, atomic_load(&s->conn->binary), rooms, prefix, page);
+
+    if (workpool_running() && submit_list(s->conn, &l) == 0) {
+        TRACE_END(TP_CMD_LIST);
+        return;
+    }
+    send_listing(s->conn, &l, s->cb->tmpbuf, 1);
+    TRACE_END(TP_CMD_LIST);
+}
+
+static void cmd_login(struct session *s, char *name) {
+    struct node *me = s->me;
+
+    char *mail = NULL;
+    size_t mail_len = 0;
+
+    TRACE_BEGIN(TP_CMD_LOGIN);
+    start_write();
+    int taken = renameU(me, name) == -1;
+    if (!taken) {
+        // the account goes with the user, so nobody who takes the old
+        // name gets its DM peers or mail
+        if (me->acct) {
+            me->acct = account_rename(me->acct, me);
+        } else {
+            me->acct = account_login(me);
+        }
+        if (me->acct) {
+            mail_len = account_take_mail(me->acct, atomic_load(&s->conn->binary), &mail);
+        }
+    }
+    uint32_t id = me->id;
+    end_write();
+
+    if (taken) {
+        reply(s, 0, OP_LOGIN, 0, "Username %s is taken", name);
+        TRACE_END(TP_CMD_LOGIN);
+        return;
+    }
+    reply(s, 1, OP_LOGIN, id, "Logged in as %s", name);
+
+    // everything that came in while offline, in one write
+    if (mail) {
+        conn_send(s->conn, mail, mail_len);
+        free(mail);
+    }
+    TRACE_END(TP_CMD_LOGIN);
+}
+
+// sending a message according to rooms and DMs
+static void cmd_message(struct session *s, const char *body, size_t len) {
+    struct node *currentUser = s->me;
+
+    TRACE_BEGIN(TP_CMD_MESSAGE);
+    start_read();
+    struct chat_msg *msg = chat_msg_new(currentUser->id, currentUser->username, body, len);
+    if (!msg) {
+        end_read();
+        TRACE_END(TP_CMD_MESSAGE);
+        return;
+    }
+
+    uint32_t *recipients;
+    int throttled;
+    int rc = build_recipients(currentUser, &recipients, &throttled);
+    int stored = currentUser->acct ? account_store(currentUser->acct, body, len) : 0;
+
+    if (actors_running() && currentUser->joined != NULL) {
+        // room fan-out belongs to the room owners, DMs are sent below; the
+        // rooms and DMs claim each recipient so a shared one gets it once
+        struct room_ref *ref;
+        chat_msg_track(msg, intern_limit(&user_ids));
+        for (ref = currentUser->joined; ref != NULL; ref = ref->next) {
+            actor_post_msg(ref->room, s->conn, msg);
+        }
+        if (rc == 0) {
+            end_read();
+            free(recipients);
+            chat_msg_put(msg);
+            TRACE_END(TP_CMD_MESSAGE);
+            return;
+        }
+    }
+
+    if (rc == 0) {
+        end_read();
+        if (throttled) {
+            reply(s, 0, OP_MSG, 0, "Room is busy, message not delivered. Slow down.");
+        } else if (stored) {
+            reply(s, 1, OP_MSG, 0, "Stored for %d offline user(s).", stored);
+        } else {
+            reply(s, 0, OP_MSG, 0, "No recipients. Join a room or connect to a user first.");
+        }
+    } else {
+        // large fan-outs go to the workers; the sender's next command
+        // waits for them, so its messages stay in order
+        if (!workpool_running() || rc < config.pool_fanout_min ||
+            submit_broadcast(s->conn, recipients, rc, msg) == -1) {
+            int k;
+            TRACE_BEGIN(TP_FANOUT);
+            for (k = 0; k < rc; k++) {
+                struct node *u = findUById(head, recipients[k]);
+                if (u && u->conn && u->conn != s->conn && chat_msg_claim(msg, u->id)) {
+                    chat_msg_send(u->conn, msg);
                 }
-                end_write();
-              
-                snprintf(buffer, sizeof(buffer), "Joined room %s\nchat>", arguments[1]);
-                send(client, buffer, strlen(buffer), 0);
             }
-            else if (strcmp(arguments[0], "leave") == 0) {
-                if (arguments[1] == NULL) {
-                    send_usage(client, "leave <room>");
-                    continue;
-                }
+            TRACE_END(TP_FANOUT);
+        }
+        end_read();
+        if (throttled) {
+            reply(s, 0, OP_MSG, 0, "Some rooms are busy and did not get your message. Slow down.");
+        }
+    }
+    free(recipients);
+    chat_msg_put(msg);
+    TRACE_END(TP_CMD_MESSAGE);
+}
 
-                printf("leave room: %s\n", arguments[1]); 
+// counters for watching memory over a long run, see soak.c
+static void cmd_stats(struct session *s) {
+    uint32_t accounts;
+    size_t mail;
 
-                start_write();
-                struct room *r = findRoom(arguments[1]);
-                if (r) {
-                    removeUserFromRoom(r, me);
-                    deleteEmptyRooms(DEFAULT_ROOM);
-                    snprintf(buffer, sizeof(buffer), "Left room %s\nchat>", arguments[1]);
-                } else {
-                    snprintf(buffer, sizeof(buffer), "Room %s does not exist\nchat>", arguments[1]);
-                }
-                end_write();
-
-                send(client, buffer, strlen(buffer), 0);
-            } 
-            else if (strcmp(arguments[0], "connect") == 0) {
-                if (arguments[1] == NULL) {
-                    send_usage(client, "connect <user>");
-                    continue;
-                }
+    start_read();
+    uint32_t users = intern_count(&user_ids);
+    uint32_t rooms = intern_count(&room_ids);
+    offline_stats(&accounts, &mail);
+    end_read();
+
+    int buffers = 0, node;
+    for (node = 0; node < PLACE_MAX_NODES; node++) {
+        buffers += pool_in_use(&conn_buf_pools[node]);
+    }
+    struct mallinfo2 mi = mallinfo2();
+    reply(s, 1, OP_STATS, 0,
+          "Stats: users %u, rooms %u, connections %d, accounts %u, mail %zu, "
+          "buffers %d, heap %zu, free %zu, parked %d",
+          users, rooms, atomic_load(&active_conns), accounts, mail,
+          buffers, mi.uordblks + mi.hblkhd, mi.fordblks, park_count());
+}
+
+////////////////////// LARGE MESSAGES /////////////////////////
+// a message longer than one read is relayed piece by piece as it arrives,
+// to recipients fixed when it starts
+
+static void relay_start(struct session *s) {
+    struct node *me = s->me;
+    uint32_t *recipients;
+    int throttled, k;
+
+    struct relay *r = relay_new(me->id, me->username);
+    if (!r) {
+        return;
+    }
+    TRACE_BEGIN(TP_CMD_RELAY);
+
+    start_read();
+    int rc = build_recipients(me, &recipients, &throttled);
+    for (k = 0; k < rc; k++) {
+        struct node *u = findUById(head, recipients[k]);
+        if (u && u->conn) {
+            relay_add(r, u->conn);
+        }
+    }
+    end_read();
+    free(recipients);
+
+    if (actors_running() && me->joined != NULL) {
+        // room members are known only to the room owners
+        struct actor_sync sync;
+        struct room_ref *ref;
+        actor_sync_init(&sync);
+        start_read();
+        for (ref = me->joined; ref != NULL; ref = ref->next) {
+            actor_post_relay(ref->room, s->conn, r, &sync);
+        }
+        end_read();
+        actor_sync_wait(&sync);
+    }
+    relay_seal(r, s->conn);
+
+    if (r->count == 0) {
+        r->discarding = 1;
+        if (throttled) {
+            reply(s, 0, OP_MSG, 0, "Room is busy, message not delivered. Slow down.");
+        } else if (!actors_running() || me->joined == NULL) {
+            reply(s, 0, OP_MSG, 0, "No recipients. Join a room or connect to a user first.");
+        }
+    } else if (throttled) {
+        reply(s, 0, OP_MSG, 0, "Some rooms are busy and did not get your message. Slow down.");
+    }
+    s->conn->relay = r;
+    TRACE_END(TP_CMD_RELAY);
+}
+
+// charge a piece after the first to the fan-out budget of every room the
+// relay goes to, as relay_start did for the first; return 0 if one is over it
+static int relay_charge(struct session *s, struct relay *r) {
+    struct node *me = s->me;
+    int ok = 1;
+
+    if (config.room_fanout_rate <= 0 || r->count == 0) {
+        return 1;
+    }
+    if (actors_running()) {
+        struct actor_sync sync;
+        struct room_ref *ref;
+        actor_sync_init(&sync);
+        start_read();
+        for (ref = me->joined; ref != NULL; ref = ref->next) {
+            actor_post_charge(ref->room, s->conn, r, &sync);
+        }
+        end_read();
+        actor_sync_wait(&sync);
+        return !atomic_load(&r->busy);
+    }
+
+    start_read();
+    struct room *room;
+    for (room = room_head; room != NULL; room = room->next) {
+        if (inRoom(room, me) && !take_fanout(room, room->member_count - 1)) {
+            ok = 0;
+        }
+    }
+    end_read();
+    return ok;
+}
+
+// relay the next piece of a large message; last ends it
+static void relay_piece(struct session *s, const char *body, size_t len, int last) {
+    struct relay *r = s->conn->relay;
+
+    TRACE_BEGIN(TP_CMD_RELAY);
+    if (!r->discarding && !r->first && !relay_charge(s, r)) {
+        // recipients see the message end here, the rest is dropped
+        relay_send(r, "", 0, 1);
+        r->discarding = 1;
+        reply(s, 0, OP_MSG, 0, "Room is busy, message cut at %zu bytes. Slow down.", r->sent);
+    }
+    if (!r->discarding) {
+        size_t left = (size_t) config.max_message - r->sent;
+        int cut = len > left;
+        relay_send(r, body, cut ? left : len, last || cut);
+        if (cut) {
+            // recipients have seen the end of it, drop the rest as it arrives
+            r->discarding = 1;
+            reply(s, 0, OP_MSG, 0, "Message cut at %ld bytes.", config.max_message);
+        }
+    }
+    if (last) {
+        relay_free(r);
+        s->conn->relay = NULL;
+    }
+    TRACE_END(TP_CMD_RELAY);
+}
+
+// the sender left part way through; end the message for its recipients
+static void relay_abort(struct conn *conn) {
+    struct relay *r = conn->relay;
+    if (r) {
+        if (!r->discarding) {
+            relay_send(r, "", 0, 1);
+        }
+        relay_free(r);
+        conn->relay = NULL;
+    }
+}
+
+////////////////////// BINARY PROTOCOL /////////////////////////
+
+// copy a name out of a frame payload, return 0 if it is empty
+static int payload_name(const char *payload, size_t len, char *name, size_t max) {
+    if (len == 0) return 0;
+    if (len >= max) len = max - 1;
+    memcpy(name, payload, len);
+    name[len] = '\0';
+    return name[0] != '\0';
+}
+
+// resolve the room or user id at the start of a payload to its name
+static int payload_id_name(const char *payload, size_t len, int rooms,
+                           uint32_t *id, char *name, size_t max) {
+    int found = 0;
+
+    if (len < 4) return 0;
+    *id = get_u32(payload);
+
+    start_read();
+    if (rooms) {
+        struct room *r = findRoomById(*id);
+        if (r) {
+            snprintf(name, max, "%s", r->name);
+            found = 1;
+        }
+    } else {
+        struct node *u = findUById(head, *id);
+        if (u) {
+            snprintf(name, max, "%s", u->username);
+            found = 1;
+        }
+    }
+    end_read();
+    return found;
+}
+
+// run one binary frame, return -1 when the client is leaving
+static int dispatch_binary(struct session *s, uint8_t op, const char *payload, size_t len) {
+    char name[32];
+    uint32_t id = 0;
+
+    wait_jobs(s->conn);
+
+    switch (op) {
+    case OP_LOGIN:
+    case OP_CREATE:
+        if (!payload_name(payload, len, name, sizeof(name))) {
+            reply(s, 0, op, 0, "Missing name");
+        } else if (op == OP_LOGIN) {
+            cmd_login(s, name);
+        } else {
+            cmd_create(s, name);
+        }
+        break;
+    case OP_JOIN:
+    case OP_LEAVE:
+        if (!payload_id_name(payload, len, 1, &id, name, sizeof(name))) {
+            reply(s, 0, op, id, "Room %u does not exist", id);
+        } else if (op == OP_JOIN) {
+            cmd_join(s, name);
+        } else {
+            cmd_leave(s, name);
+        }
+        break;
+    case OP_CONNECT:
+    case OP_DISCONNECT:
+        if (!payload_id_name(payload, len, 0, &id, name, sizeof(name))) {
+            reply(s, 0, op, id, "User %u not found", id);
+        } else if (op == OP_CONNECT) {
+            cmd_connect(s, name);
+        } else {
+            cmd_disconnect(s, name);
+        }
+        break;
+    case OP_USERS:
+    case OP_ROOMS:
+        // optional u32 page, then an optional name prefix
+        if (len >= 4) {
+            name[0] = '\0';   // no prefix when only a page is given
+            payload_name(payload + 4, len - 4, name, sizeof(name));
+            cmd_list(s, op == OP_ROOMS, name, get_u32(payload));
+        } else {
+            cmd_list(s, op == OP_ROOMS, NULL, 0);
+        }
+        break;
+    case OP_MSG:
+        if (s->conn->relay) {
+            relay_piece(s, payload, len, 1);
+        } else {
+            cmd_message(s, payload, len);
+        }
+        break;
+    case OP_MSG_PART:
+        if (!s->conn->relay) {
+            relay_start(s);
+        }
+        if (s->conn->relay) {
+            relay_piece(s, payload, len, 0);
+        }
+        break;
+    case OP_STATS:
+        cmd_stats(s);
+        break;
+    case OP_EXIT:
+        return -1;
+    default:
+        reply(s, 0, op, 0, "Unknown opcode %u", op);
+        break;
+    }
+    return 0;
+}
+
+// run every complete frame in data, keeping a trailing partial frame for the
+// next read; return -1 on exit or a malformed frame
+static int handle_binary(struct session *s, const char *data, size_t len) {
+    struct conn *conn = s->conn;
+    const char *p = data;
+    size_t avail = len;
+
+    if (conn->inbuf) {
+        char *grown = (char *) realloc(conn->inbuf, conn->inlen + len);
+        if (!grown) {
+            perror("realloc");
+            return -1;
+        }
+        memcpy(grown + conn->inlen, data, len);
+        conn->inbuf = grown;
+        conn->inlen += len;
+        p = conn->inbuf;
+        avail = conn->inlen;
+    }
+
+    int status = 0;
+    while (status == 0) {
+        uint8_t op;
+        const char *payload;
+        size_t plen;
+        long n = bin_parse(p, avail, &op, &payload, &plen);
+        if (n == 0) break;
+        if (n < 0) {
+            status = -1;
+            break;
+        }
+        status = dispatch_binary(s, op, payload, plen);
+        p += n;
+        avail -= n;
+    }
+
+    // keep what is left of a partial frame, and nothing otherwise; a
+    // partial frame is always shorter than the largest frame
+    if (status == 0 && avail >= BIN_MAX_FRAME) {
+        status = -1;
+    }
+    if (status == 0 && avail > 0) {
+        char *rest = (char *) malloc(avail);
+        if (!rest) {
+            perror("malloc");
+            return -1;
+        }
+        memcpy(rest, p, avail);
+        free(conn->inbuf);
+        conn->inbuf = rest;
+        conn->inlen = avail;
+    } else {
+        free(conn->inbuf);
+        conn->inbuf = NULL;
+        conn->inlen = 0;
+    }
+    return status;
+}
+
+// switch a text client to binary framing; anything it sent after the
+// "binary" line is already framed
+static void start_binary(struct session *s) {
+    char hello[BIN_HEADER + 4];
+
+    atomic_store(&s->conn->binary, 1);
+    bin_header(hello, OP_HELLO, 4);
+    put_u32(hello + BIN_HEADER, s->me->id);
+    conn_send(s->conn, hello, sizeof(hello));
+}
+
+////////////////////// TEXT PROTOCOL /////////////////////////
+
+// run one text command line, return -1 when the client is leaving
+static int handle_text(struct session *s, const char *line) {
+    char *cmd = s->cb->cmd;
+    char **arguments = s->cb->arguments;
+    struct conn *conn = s->conn;
+    int i;
+
+    wait_jobs(conn);
+    strcpy(cmd, line);
+
+    // tokenize input
+    arguments[0] = strtok(cmd, delimiters);
+    i = 0;
+    while (arguments[i] != NULL) {
+        arguments[i] = trimwhitespace(arguments[i]);
+        i++;
+        // commands use the first few words; a long message can have more than fit
+        arguments[i] = i + 1 < (int)(sizeof(s->cb->arguments) / sizeof(char *)) ?
+                       strtok(NULL, delimiters) : NULL;
+    }
+
+    if (arguments[0] == NULL) {
+        send_prompt(conn);
+        return 0;
+    }
 
-                printf("connect to user: %s \n", arguments[1]);
-
-                start_write();
-                struct node *peer = findU(head, arguments[1]);
-                if (peer) {
-                    if (me == peer) {
-                        send_error(client, "Cannot connect to yourself");
-                    } else {
-                        addDM(me, peer);
-                        snprintf(buffer, sizeof(buffer), "Connected to %s\nchat>", arguments[1]);
-                        send(client, buffer, strlen(buffer), 0);
-                    }
-                } else {
-                    snprintf(buffer, sizeof(buffer), "User %s not found\nchat>", arguments[1]);
-                    send(client, buffer, strlen(buffer), 0);
+    // Execute command
+
+    if (strcmp(arguments[0], "create") == 0) {
+        if (arguments[1] == NULL) {
+            send_usage(conn, "create <room>");
+            return 0;
+        }
+        cmd_create(s, arguments[1]);
+    }
+    else if (strcmp(arguments[0], "join") == 0) {
+        if (arguments[1] == NULL) {
+            send_usage(conn, "join <room>");
+            return 0;
+        }
+        cmd_join(s, arguments[1]);
+    }
+    else if (strcmp(arguments[0], "leave") == 0) {
+        if (arguments[1] == NULL) {
+            send_usage(conn, "leave <room>");
+            return 0;
+        }
+        cmd_leave(s, arguments[1]);
+    } 
+    else if (strcmp(arguments[0], "connect") == 0) {
+        if (arguments[1] == NULL) {
+            send_usage(conn, "connect <user>");
+            return 0;
+        }
+        cmd_connect(s, arguments[1]);
+    }
+    else if (strcmp(arguments[0], "disconnect") == 0) {             
+        if (arguments[1] == NULL) {
+            send_usage(conn, "disconnect <user>");
+            return 0;
+        }
+        cmd_disconnect(s, arguments[1]);
+    }                  
+    else if (strcmp(arguments[0], "rooms") == 0 || strcmp(arguments[0], "users") == 0) {
+        int rooms = arguments[0][0] == 'r';
+        const char *prefix = arguments[1];
+        const char *page = arguments[1] ? arguments[2] : NULL;
+        char *end;
+
+        // a lone number is a page of the full listing
+        if (page == NULL && prefix != NULL && strspn(prefix, "0123456789") == strlen(prefix)) {
+            page = prefix;
+            prefix = NULL;
+        }
+        long n = page ? strtol(page, &end, 10) : 0;
+        if (page && (*end != '\0' || n < 1 || n > UINT32_MAX)) {
+            send_usage(conn, rooms ? "rooms [prefix] [page]" : "users [prefix] [page]");
+            return 0;
+        }
+        cmd_list(s, rooms, prefix, (uint32_t) n);
+    }                           
+    else if (strcmp(arguments[0], "login") == 0) {
+        if (arguments[1] == NULL) {
+            send_usage(conn, "login <username>");
+            return 0;
+        }
+        cmd_login(s, arguments[1]);
+    } 
+    else if (strcmp(arguments[0], "help") == 0) {
+        conn_send(conn, HELP_TEXT, strlen(HELP_TEXT));
+        send_prompt(conn);
+    }
+    else if (strcmp(arguments[0], "stats") == 0) {
+        cmd_stats(s);
+    }
+    else if (strcmp(arguments[0], "binary") == 0) {
+        start_binary(s);
+    }
+    else if (strcmp(arguments[0], "exit") == 0 || strcmp(arguments[0], "logout") == 0) {
+        return -1;
+    }                         
+    else { 
+        // line still has the original message text
+        cmd_message(s, line, strlen(line));
+    }
+
+    return 0;
+}
+
+// run each complete line in data on its own. A partial line waits in
+// conn->inbuf for the rest, so a message is never cut at a read boundary;
+// one that fills a whole buffer without ending is a long message, relayed
+// as it arrives. return -1 when the client is leaving
+static int handle_lines(struct session *s, const char *data, size_t len) {
+    struct conn *conn = s->conn;
+    char *line = s->cb->line;
+    int lines = 0;
+
+    while (len > 0) {
+        if (atomic_load(&conn->binary)) {
+            // the rest came after a "binary" line
+            return handle_binary(s, data, len);
+        }
+        const char *nl = memchr(data, '\n', len);
+        size_t used = nl ? (size_t)(nl + 1 - data) : len;
+
+        if (conn->relay) {
+            // the rest of a long message runs up to the end of the line
+            relay_piece(s, data, used, nl != NULL);
+            data += used;
+            len -= used;
+            continue;
+        }
+
+        // put the line together with what earlier reads left of it
+        size_t n = conn->inlen;
+        size_t take = MAXBUFF - 1 - n < used ? MAXBUFF - 1 - n : used;
+        if (n > 0) {
+            memcpy(line, conn->inbuf, n);
+            free(conn->inbuf);
+            conn->inbuf = NULL;
+            conn->inlen = 0;
+        }
+        memcpy(line + n, data, take);
+        n += take;
+        data += take;
+        len -= take;
+
+        if (line[n - 1] != '\n') {
+            if (n == MAXBUFF - 1) {
+                // a full buffer with no end of line: relay it as it arrives
+                wait_jobs(conn);
+                relay_start(s);
+                if (conn->relay) {
+                    relay_piece(s, line, n, 0);
                 }
-                end_write();
+                continue;
             }
-            else if (strcmp(arguments[0], "disconnect") == 0) {             
-                if (arguments[1] == NULL) {
-                    send_usage(client, "disconnect <user>");
-                    continue;
-                }
+            conn->inbuf = (char *) malloc(n);
+            if (!conn->inbuf) {
+                perror("malloc");
+                return -1;
+            }
+            memcpy(conn->inbuf, line, n);
+            conn->inlen = n;
+            return 0;
+        }
 
-                printf("disconnect from user: %s\n", arguments[1]);
-               
-                start_write();
-                struct node *peer = findU(head, arguments[1]);
-                if (peer) {
-                    removeDM(me, peer);
-                    snprintf(buffer, sizeof(buffer), "Disconnected from %s\nchat>", arguments[1]);
-                    send(client, buffer, strlen(buffer), 0);
-                } else {
-                    snprintf(buffer, sizeof(buffer), "User %s not found\nchat>", arguments[1]);
-                    send(client, buffer, strlen(buffer), 0);
-                }
-                end_write();
-            }                  
-            else if (strcmp(arguments[0], "rooms") == 0) {
-                printf("List all the rooms\n");
-              
-                start_read();
-                listRooms(room_head, buffer, MAXBUFF);
-                end_read();
-       
-                strncat(buffer, "chat>", MAXBUFF - strlen(buffer) - 1);
-                send(client, buffer, strlen(buffer), 0);
-            }   
-            else if (strcmp(arguments[0], "users") == 0) {
-                printf("List all the users\n");
-              
-                start_read();
-                listUsers(head, buffer, MAXBUFF);
-                end_read();
-                
-                strncat(buffer, "chat>", MAXBUFF - strlen(buffer) - 1);
-                send(client, buffer, strlen(buffer), 0);
-            }                           
-            else if (strcmp(arguments[0], "login") == 0) {
-                if (arguments[1] == NULL) {
-                    send_usage(client, "login <username>");
-                    continue;
-                }
+        // every line is a message for flood control, not just every read
+        line[n] = '\0';
+        if (lines++ > 0 && !s->me->trusted && config.user_msg_rate > 0) {
+            tb_wait(&s->me->msg_tb, 1);
+        }
+        if (handle_text(s, line) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
 
-                start_write();
-                strncpy(me->username, arguments[1], sizeof(me->username) - 1);
-                me->username[sizeof(me->username) - 1] = '\0';
-                end_write();
-                
-                snprintf(buffer, sizeof(buffer), "Logged in as %s\nchat>", arguments[1]);
-                send(client, buffer, strlen(buffer), 0);
-            } 
-            else if (strcmp(arguments[0], "help") == 0) {
-                send(client, HELP_TEXT, strlen(HELP_TEXT));
-                send_prompt(client);
-            }
-            else if (strcmp(arguments[0], "exit") == 0 || strcmp(arguments[0], "logout") == 0) {
-                cleanup_client_user(client);
-                close(client);
-                pthread_exit(NULL);
-            }                         
-            else { 
-                // sending a message according to rooms and DMs
-
-                start_read();
-                currentUser = me;
-                if (!currentUser) {
-                    end_read();
-                    continue;
-                }
+// process one chunk of client input held in cb->buffer
+// return 0 to keep the connection open, -1 when the client is leaving
+static int handle_input(int client, struct conn *conn, struct conn_buf *cb, int received) {
+    cb->buffer[received] = '\0';
+
+    // cache current user for this iteration
+    start_read();
+    struct node *me = conn_user(conn);
+    end_read();
+
+    if (!me) {
+        // user missing from list, clean up and exit
+        return -1;
+    }
+
+    throttle_input(me, received);
+
+    // replies to this input, and output others queue meanwhile, go out with
+    // the flush after it
+    conn_claim_flush(conn);
+
+    struct session s = { client, conn, me, cb };
+    if (atomic_load(&conn->binary)) {
+        return handle_binary(&s, cb->buffer, received);
+    }
+    return handle_lines(&s, cb->buffer, received);
+}
+
+// how long ppoll() may wait before an idle connection is parked
+static void idle_left(const struct timespec *active, struct timespec *left) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long ns = (active->tv_sec + config.park_secs - now.tv_sec) * 1000000000L +
+              (active->tv_nsec - now.tv_nsec);
+    if (ns < 0) ns = 0;
+    left->tv_sec = ns / 1000000000L;
+    left->tv_nsec = ns % 1000000000L;
+}
 
-                const char *from = currentUser->username;
-
-                // sbuffer still has the original message text
-                snprintf(tmpbuf, sizeof(tmpbuf), "\n::%s> %s\nchat>", from, sbuffer);
-                size_t msglen = strlen(tmpbuf);
-
-                struct node *recipients[max_clients];
-                int rc = build_recipients(currentUser, recipients, max_clients);
-
-                if (rc == 0) {
-                    end_read();
-                    send_error(client, "No recipients. Join a room or connect to a user first.");
-                } else {
-                    int k;
-                    for (k = 0; k < rc; k++) {
-                        if (recipients[k]->socket != client) {
-                            send(recipients[k]->socket, tmpbuf, msglen, 0);
-                        }
-                    }
-                    end_read();
+// serve the connection on the calling thread until the client leaves,
+// return 0, or until it has been idle long enough to park, return 1; a
+// parked connection belongs to the park thread from then on
+static int serve_client(struct conn *conn) {
+    int client = conn->fd;
+    int parking = park_running() && config.park_secs > 0;
+    struct timespec active;
+
+    clock_gettime(CLOCK_MONOTONIC, &active);
+    while (1) {
+        // wait for input without holding a buffer, so idle clients cost no buffer memory;
+        // the wake descriptor fires when workers have queued output for us, and
+        // coalesced output wakes us when its window ends
+        struct pollfd pfd[2] = {
+            { .fd = client, .events = POLLIN },
+            { .fd = conn->wake_fd, .events = POLLIN },
+        };
+        struct timespec left;
+        int held = conn_held(conn, &left);
+        // a relay in progress keeps the thread, the next piece is due any moment
+        int idle = !held && parking && conn->relay == NULL;
+        if (idle) {
+            idle_left(&active, &left);
+        }
+        int ready = ppoll(pfd, 2, held || idle ? &left : NULL, NULL);
+        if (ready == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        // nothing came in or went out for park_secs: give the thread up
+        if (ready == 0 && idle) {
+            idle_left(&active, &left);
+            if (left.tv_sec == 0 && left.tv_nsec == 0) {
+                if (atomic_load(&conn->queued) == 0) {
+                    park_conn(conn);
+                    return 1;
                 }
+                clock_gettime(CLOCK_MONOTONIC, &active);
             }
- 
-            memset(buffer, 0, sizeof(buffer));
-        } else {
-            // client disconnected or error
-            cleanup_client_user(client);
-            close(client);
-            pthread_exit(NULL);
         }
+        if (ready > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &active);
+        }
+
+        // zero-copy completions show up as POLLERR; only read when
+        // something else is there too
+        if ((pfd[0].revents & POLLERR) && conn->zc_on && conn_reap(conn) > 0) {
+            pfd[0].revents &= ~POLLERR;
+        }
+        if ((pfd[1].revents & POLLIN) || held) {
+            conn_flush(conn, 0);
+        }
+        if (!(pfd[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            continue;
+        }
+
+        // a thread that is not pinned may move, so the buffer goes back to
+        // the pool it came from
+        struct buf_pool *pool = &conn_buf_pools[place_node()];
+        struct conn_buf *cb = pool_get(pool);
+        if (!cb) {
+            break;
+        }
+
+        int received = read(client, cb->buffer, MAXBUFF - 1);
+        int status = -1;
+        if (received > 0) {
+            status = handle_input(client, conn, cb, received);
+        } else if (received == -1 && errno == EINTR) {
+            status = 0;
+        }
+        pool_put(pool, cb);
+
+        if (status == -1) {
+            // client left, disconnected or errored
+            break;
+        }
+        conn_flush(conn, 0);
     }
+    return 0;
+}
+
+// the client is leaving: send what is left and take it out of everything
+static void end_client(struct conn *conn) {
+    int client = conn->fd;
+    relay_abort(conn);
+    conn_flush(conn, 1);
+    conn_settle(conn, ZEROCOPY_SETTLE_MS);
+    cleanup_client_user(conn);
+    finish_client(client, conn);
+}
+
+void *client_receive(void *ptr) {
+    int client = (int)(intptr_t) ptr;  // socket
+    char username[20];
+
+    TRACE_THREAD("client", -1);
+
+    // Creating the guest user name
+    snprintf(username, sizeof(username), "guest%d", client);
+
+    struct conn *conn = conn_new(client);
+    if (!conn) {
+        finish_client(client, NULL);
+        return NULL;
+    }
+    conn_send(conn, server_MOTD, strlen(server_MOTD)); // Send MOTD
+
+    long uid = peer_uid(client);
+
+    // add user and put into Lobby
+    start_write();
+    head = insertFirstU(head, client, username);
+    struct node *me_init = findU(head, username);
+    if (me_init && me_init->conn == NULL) {
+        me_init->conn = conn;
+        conn->user_id = me_init->id;
+    } else {
+        me_init = NULL;   // the name was taken, so no user was added
+    }
+
+    if (me_init) {
+        tb_init(&me_init->msg_tb, config.user_msg_rate, 2 * config.user_msg_rate);
+        tb_init(&me_init->byte_tb, config.user_byte_rate, 2 * config.user_byte_rate);
+        me_init->uid = uid;
+        me_init->trusted = uid >= 0 && uid == config.trusted_uid;
+        if (actors_running()) {
+            actor_sync_init(&me_init->room_ops);
+        }
+    }
+
+    struct room *lobby = createRoom(DEFAULT_ROOM);
+    if (lobby && me_init && !actors_running()) {
+        addUserToRoom(lobby, me_init);
+    } else if (lobby && me_init && track_room(me_init, lobby)) {
+        actor_post_join(lobby, me_init, &me_init->room_ops);
+    }
+    end_write();
+
+    if (serve_client(conn) == 0) {
+        end_client(conn);
+    }
+    return NULL;
+}
+
+// a parked connection woke up; serve it on this new thread
+void *client_resume(void *ptr) {
+    struct conn *conn = (struct conn *) ptr;
+
+    TRACE_THREAD("client", -1);
+    if (serve_client(conn) == 0) {
+        end_client(conn);
+    }
+    return NULL;
+}
 
-    // fallback
-    cleanup_client_user(client);
-    close(client);
-    pthread_exit(NULL);
+// no thread could be started for a parked connection
+void client_drop(struct conn *conn) {
+    int client = conn->fd;
+    conn_kill(conn);
+    cleanup_client_user(conn);
+    finish_client(client, conn);
 }
@@ -0,0 +1,490 @@
+// soak: drive a random mix of commands against a local server for a long
+// time, sampling its memory and response time, and fail if either drifts
+//
+// run the server with -r 0 so reconnects are not turned away, then
+//     ./soak [-n clients] [-t seconds] [-r ops_per_sec] [-i sample_sec]
+//            [-w warmup_sec] [-g max_growth_pct] [-l max_latency_ratio]
+//            [-p server_pid] [-s seed]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define PORT 8888
+#define SOAK_ROOMS 50            // rooms the clients move between
+#define PROBES 5                 // stats round trips per sample, the median counts
+#define RECENT 3                 // samples the end of the run is judged on
+#define LATENCY_FLOOR_MS 5.0     // response times under this never count as drift
+#define PROBE_TIMEOUT_S 5
+#define REPLY_WAIT_MS 1000.0     // a command with no reply by then stops blocking the next
+
+struct options {
+    int clients;
+    long seconds;
+    double rate;                 // commands per second across all clients
+    long interval;               // seconds between samples
+    long warmup;                 // seconds before the baseline sample
+    double max_growth;           // percent over the baseline
+    double max_latency;          // times the baseline
+    int pid;
+    unsigned seed;
+};
+
+// what one sample saw
+struct sample {
+    long rss_kb;
+    size_t heap, heap_free, mail;
+    unsigned users, rooms, accounts;
+    int conns, buffers;
+    double latency_ms;
+};
+
+// one churning connection; it keeps one command outstanding at a time, so
+// the time to each reply can be measured
+struct client {
+    int fd;                      // -1 while disconnected
+    double sent_at;              // when the unanswered command went out, 0 if none
+};
+
+static unsigned long long rng_state;
+
+static unsigned rnd(unsigned n) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (unsigned) (rng_state % n);
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static int dial(void) {
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// the resident size of pid in kB, -1 if it is gone or a zombie, which
+// has no memory left to measure
+static long read_rss_kb(int pid) {
+    char path[64], line[256];
+    long kb = -1;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char state;
+        if (sscanf(line, "State: %c", &state) == 1 && state == 'Z') {
+            break;
+        }
+        if (sscanf(line, "VmRSS: %ld", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+// the server's pid, from -p or the first live process named "server"
+static int find_server(void) {
+    DIR *d = opendir("/proc");
+    struct dirent *e;
+    int pid = 0;
+
+    if (!d) {
+        return 0;
+    }
+    while (pid == 0 && (e = readdir(d)) != NULL) {
+        char path[300], comm[64];
+        int n = atoi(e->d_name);
+        if (n <= 0) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/proc/%d/comm", n);
+        FILE *f = fopen(path, "r");
+        if (f) {
+            // a server that exited but was not reaped yet still has its name
+            if (fgets(comm, sizeof(comm), f) && strcmp(comm, "server\n") == 0 &&
+                read_rss_kb(n) >= 0) {
+                pid = n;
+            }
+            fclose(f);
+        }
+    }
+    closedir(d);
+    return pid;
+}
+
+////////////////////// CHURN /////////////////////////
+
+static void send_line(int fd, const char *line) {
+    // a client the server is pushing back on just skips this command
+    send(fd, line, strlen(line), MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+// throw away whatever the server sent, noting in *replied whether any of
+// it was more than chat from others; return -1 once the server hung up
+static int drain(int fd, int *replied) {
+    char buf[8192];
+    while (1) {
+        ssize_t n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n > 0) {
+            if (n < 3 || memcmp(buf, "\n::", 3) != 0) {
+                *replied = 1;
+            }
+            continue;
+        }
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            return -1;
+        }
+        return 0;
+    }
+}
+
+// one random command from c, weighted toward chat
+static void churn(struct client *c, int clients, int i, unsigned long seq) {
+    char line[128];
+    unsigned roll = rnd(100);
+
+    if (c->fd == -1 || roll < 8) {
+        // leave without a word, or come back, so cleanup runs all the time
+        if (c->fd != -1) {
+            close(c->fd);
+        }
+        c->fd = dial();
+        c->sent_at = now_ms();   // the greeting counts as the reply
+        return;
+    }
+    if (c->sent_at != 0 && now_ms() - c->sent_at < REPLY_WAIT_MS) {
+        return;
+    }
+    if (roll < 38) {
+        snprintf(line, sizeof(line), "soak message %lu from %d\n", seq, i);
+    } else if (roll < 48) {
+        snprintf(line, sizeof(line), "join r%u\n", rnd(SOAK_ROOMS));
+    } else if (roll < 58) {
+        snprintf(line, sizeof(line), "leave r%u\n", rnd(SOAK_ROOMS));
+    } else if (roll < 70) {
+        // names collide often, so taken names and renames both get exercised
+        snprintf(line, sizeof(line), "login u%u\n", rnd(2 * clients));
+    } else if (roll < 79) {
+        snprintf(line, sizeof(line), "connect u%u\n", rnd(2 * clients));
+    } else if (roll < 87) {
+        snprintf(line, sizeof(line), "disconnect u%u\n", rnd(2 * clients));
+    } else if (roll < 91) {
+        snprintf(line, sizeof(line), "create r%u\n", rnd(SOAK_ROOMS));
+    } else if (roll < 96) {
+        snprintf(line, sizeof(line), "users u%u 1\n", rnd(10));
+    } else {
+        snprintf(line, sizeof(line), "rooms 1\n");
+    }
+    send_line(c->fd, line);
+    c->sent_at = now_ms();
+}
+
+////////////////////// SAMPLES /////////////////////////
+
+// read from the probe connection until text and the rest of its line are in,
+// return it or NULL on timeout; buf holds max bytes
+static char *wait_for(int fd, const char *text, char *buf, size_t max) {
+    size_t have = 0;
+    while (have < max - 1) {
+        ssize_t n = recv(fd, buf + have, max - 1 - have, 0);
+        if (n <= 0) {
+            return NULL;
+        }
+        have += n;
+        buf[have] = '\0';
+        char *p = strstr(buf, text);
+        if (p && strchr(p, '\n')) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// one stats round trip on the probe connection, or -1 on timeout
+static double probe_once(int fd, struct sample *s) {
+    char buf[4096];
+    int replied;
+
+    drain(fd, &replied);
+    double start = now_ms();
+    send_line(fd, "stats\n");
+    char *p = wait_for(fd, "Stats:", buf, sizeof(buf));
+    if (p) {
+        double ms = now_ms() - start;
+        sscanf(p, "Stats: users %u, rooms %u, connections %d, accounts %u, mail %zu, "
+                  "buffers %d, heap %zu, free %zu",
+               &s->users, &s->rooms, &s->conns, &s->accounts, &s->mail,
+               &s->buffers, &s->heap, &s->heap_free);
+        return ms;
+    }
+    return -1;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// return -1 if the server did not answer, -2 if its RSS could not be read
+static int take_sample(int probe, int pid, struct sample *s) {
+    double ms[PROBES];
+    int i;
+
+    memset(s, 0, sizeof(*s));
+    for (i = 0; i < PROBES; i++) {
+        ms[i] = probe_once(probe, s);
+        if (ms[i] < 0) {
+            return -1;
+        }
+    }
+    qsort(ms, PROBES, sizeof(double), cmp_double);
+    s->latency_ms = ms[PROBES / 2];
+    s->rss_kb = read_rss_kb(pid);
+    return s->rss_kb < 0 ? -2 : 0;
+}
+
+static void print_sample(double t, const struct sample *s, long idle_kb) {
+    long per_conn = s->conns > 0 ? (s->rss_kb - idle_kb) * 1024 / s->conns : 0;
+    printf("%7.0fs rss %ld kB, heap %zu, free %zu, conns %d, users %u, rooms %u, "
+           "accounts %u, mail %zu, buffers %d, %ld B/conn, latency %.2f ms\n",
+           t, s->rss_kb, s->heap, s->heap_free, s->conns, s->users, s->rooms,
+           s->accounts, s->mail, s->buffers, per_conn, s->latency_ms);
+    fflush(stdout);
+}
+
+static double growth(double now, double base) {
+    return base > 0 ? (now - base) * 100.0 / base : 0;
+}
+
+// heap not counting mailboxes; mail is read a moment after the heap, so it
+// can come out larger
+static size_t heap_less_mail(const struct sample *s) {
+    return s->heap > s->mail ? s->heap - s->mail : 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-n clients] [-t seconds] [-r ops_per_sec] [-i sample_sec]\n"
+            "          [-w warmup_sec] [-g max_growth_pct] [-l max_latency_ratio]\n"
+            "          [-p server_pid] [-s seed]\n"
+            "  -n  connections kept open (default 200)\n"
+            "  -t  length of the run in seconds (default 3600)\n"
+            "  -r  commands per second across all clients (default 2000)\n"
+            "  -i  seconds between samples (default 10)\n"
+            "  -w  seconds of churn before the baseline sample (default 60)\n"
+            "  -g  largest RSS or heap growth over the baseline, percent (default 20)\n"
+            "  -l  largest response time over the baseline, as a ratio (default 3)\n"
+            "  -p  server pid (default: the first process named server)\n"
+            "  -s  random seed (default: the time)\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    struct options o = { 200, 3600, 2000, 10, 60, 20, 3, 0, (unsigned) time(NULL) };
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "n:t:r:i:w:g:l:p:s:h")) != -1) {
+        switch (opt) {
+        case 'n': o.clients = atoi(optarg); break;
+        case 't': o.seconds = atol(optarg); break;
+        case 'r': o.rate = atof(optarg); break;
+        case 'i': o.interval = atol(optarg); break;
+        case 'w': o.warmup = atol(optarg); break;
+        case 'g': o.max_growth = atof(optarg); break;
+        case 'l': o.max_latency = atof(optarg); break;
+        case 'p': o.pid = atoi(optarg); break;
+        case 's': o.seed = (unsigned) strtoul(optarg, NULL, 10); break;
+        default:
+            usage(argv[0]);
+            exit(opt == 'h' ? 0 : 2);
+        }
+    }
+    if (o.clients < 1 || o.seconds < 1 || o.rate <= 0 || o.interval < 1 ||
+        o.warmup < 0 || o.warmup >= o.seconds || o.max_growth <= 0 || o.max_latency <= 1) {
+        usage(argv[0]);
+        exit(2);
+    }
+    rng_state = o.seed ? o.seed : 1;
+    if (o.pid == 0 && (o.pid = find_server()) == 0) {
+        fprintf(stderr, "no server process found, use -p\n");
+        exit(2);
+    }
+
+    // the probe stays out of every room, so it only ever sees its own replies
+    int probe = dial();
+    if (probe == -1) {
+        perror("connect");
+        exit(2);
+    }
+    struct timeval tv = { PROBE_TIMEOUT_S, 0 };
+    setsockopt(probe, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    struct sample idle = { 0 }, base = { 0 }, last = { 0 }, recent[RECENT];
+    char buf[4096];
+    send_line(probe, "leave Lobby\n");
+    int rc = wait_for(probe, "Left room", buf, sizeof(buf)) ? take_sample(probe, o.pid, &idle) : -1;
+    if (rc == -1) {
+        fprintf(stderr, "no stats reply from the server\n");
+        exit(2);
+    } else if (rc == -2) {
+        fprintf(stderr, "cannot read the RSS of pid %d\n", o.pid);
+        exit(2);
+    }
+    printf("seed %u, server pid %d, idle rss %ld kB\n", o.seed, o.pid, idle.rss_kb);
+
+    struct client *cl = (struct client *) malloc(o.clients * sizeof(struct client));
+    struct pollfd *pfds = (struct pollfd *) malloc(o.clients * sizeof(struct pollfd));
+    if (!cl || !pfds) {
+        perror("malloc");
+        exit(2);
+    }
+    for (i = 0; i < o.clients; i++) {
+        cl[i].fd = dial();
+        cl[i].sent_at = now_ms();
+    }
+
+    double start = now_ms(), next_sample = start + o.interval * 1000.0;
+    double owed = 0, last_tick = start;
+    unsigned long seq = 0;
+    int have_base = 0, nrecent = 0;
+    int failed = 0;
+
+    while (now_ms() - start < o.seconds * 1000.0) {
+        double now = now_ms();
+
+        // commands owed since the last pass, spread over random clients
+        owed += (now - last_tick) * o.rate / 1000.0;
+        last_tick = now;
+        while (owed >= 1) {
+            i = rnd(o.clients);
+            churn(&cl[i], o.clients, i, seq++);
+            owed -= 1;
+        }
+
+        int n = 0;
+        for (i = 0; i < o.clients; i++) {
+            pfds[i].fd = cl[i].fd;   // -1 entries are ignored by poll
+            pfds[i].events = POLLIN;
+            pfds[i].revents = 0;
+        }
+        n = poll(pfds, o.clients, 10);
+        for (i = 0; n > 0 && i < o.clients; i++) {
+            int replied = 0;
+            if (pfds[i].revents == 0) {
+                continue;
+            }
+            if (drain(cl[i].fd, &replied) == -1) {
+                close(cl[i].fd);
+                cl[i].fd = -1;
+            } else if (replied) {
+                cl[i].sent_at = 0;
+            }
+        }
+
+        if (now_ms() < next_sample) {
+            continue;
+        }
+        next_sample += o.interval * 1000.0;
+        rc = take_sample(probe, o.pid, &last);
+        if (rc == -1) {
+            printf("FAIL: no stats reply within %d seconds\n", PROBE_TIMEOUT_S);
+            failed = 1;
+            break;
+        } else if (rc == -2) {
+            printf("FAIL: server pid %d is gone\n", o.pid);
+            failed = 1;
+            break;
+        }
+        double t = (now_ms() - start) / 1000.0;
+        print_sample(t, &last, idle.rss_kb);
+        if (!have_base && t >= o.warmup) {
+            base = last;
+            have_base = 1;
+            printf("baseline taken\n");
+        } else if (have_base) {
+            recent[nrecent++ % RECENT] = last;
+        }
+    }
+
+    if (!failed && nrecent > 0) {
+        // a leak keeps the smallest of the last few samples up, a passing
+        // spike does not; response time goes by their median
+        int k, m = nrecent < RECENT ? nrecent : RECENT;
+        double ms[RECENT];
+        last = recent[0];
+        for (k = 0; k < m; k++) {
+            if (recent[k].rss_kb < last.rss_kb) last.rss_kb = recent[k].rss_kb;
+            if (heap_less_mail(&recent[k]) < heap_less_mail(&last)) {
+                last.heap = recent[k].heap;
+                last.mail = recent[k].mail;
+            }
+            ms[k] = recent[k].latency_ms;
+        }
+        qsort(ms, m, sizeof(double), cmp_double);
+        last.latency_ms = ms[m / 2];
+
+        // offline mail fills up to its caps on its own, so it is not counted
+        double rss = growth(last.rss_kb - last.mail / 1024.0, base.rss_kb - base.mail / 1024.0);
+        double heap = growth((double) heap_less_mail(&last), (double) heap_less_mail(&base));
+        double lat = base.latency_ms > LATENCY_FLOOR_MS ? base.latency_ms : LATENCY_FLOOR_MS;
+
+        printf("rss %+.1f%%, heap %+.1f%%, latency %.2f ms against %.2f ms\n",
+               rss, heap, last.latency_ms, base.latency_ms);
+        if (rss > o.max_growth) {
+            printf("FAIL: rss grew %.1f%%, limit %.1f%%\n", rss, o.max_growth);
+            failed = 1;
+        }
+        if (heap > o.max_growth) {
+            printf("FAIL: heap grew %.1f%%, limit %.1f%%\n", heap, o.max_growth);
+            failed = 1;
+        }
+        if (last.latency_ms > lat * o.max_latency) {
+            printf("FAIL: latency %.2f ms, limit %.2f ms\n", last.latency_ms, lat * o.max_latency);
+            failed = 1;
+        }
+    } else if (!failed) {
+        printf("FAIL: no samples after the baseline, make -t longer than -w plus -i\n");
+        failed = 1;
+    }
+
+    for (i = 0; i < o.clients; i++) {
+        if (cl[i].fd != -1) {
+            close(cl[i].fd);
+        }
+    }
+    close(probe);
+    free(cl);
+    free(pfds);
+    printf(failed ? "soak failed\n" : "soak passed\n");
+    return failed;
+}
@@ -0,0 +1,307 @@
+#ifdef TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include "trace.h"
+
+#define TRACE_DEPTH 8            // open probes per thread, deeper ones are ignored
+#define TRACE_SLOTS 128          // distinct stacks per thread
+
+// the cycle counter where there is one, nanoseconds elsewhere
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TRACE_UNIT "cycles"
+static inline uint64_t now_ticks(void) {
+    return __rdtsc();
+}
+#else
+#define TRACE_UNIT "ns"
+static inline uint64_t now_ticks(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+#endif
+
+static const char *const probe_names[TP_COUNT] = {
+    [TP_NONE] = "none",
+    [TP_READ_WAIT] = "read_wait",
+    [TP_READ_HOLD] = "read_hold",
+    [TP_WRITE_WAIT] = "write_wait",
+    [TP_WRITE_HOLD] = "write_hold",
+    [TP_RECIPIENTS] = "build_recipients",
+    [TP_FANOUT] = "fanout",
+    [TP_CMD_CREATE] = "cmd_create",
+    [TP_CMD_JOIN] = "cmd_join",
+    [TP_CMD_LEAVE] = "cmd_leave",
+    [TP_CMD_CONNECT] = "cmd_connect",
+    [TP_CMD_DISCONNECT] = "cmd_disconnect",
+    [TP_CMD_LIST] = "cmd_list",
+    [TP_CMD_LOGIN] = "cmd_login",
+    [TP_CMD_MESSAGE] = "cmd_message",
+    [TP_CMD_RELAY] = "cmd_relay",
+    [TP_CLEANUP] = "cleanup",
+};
+
+// a stack of probes packed one byte each, root in the highest byte in use
+struct trace_entry {
+    uint64_t path;               // 0 marks a free slot
+    uint64_t calls;
+    uint64_t ticks;              // self time, without the probes opened inside
+};
+
+struct trace_frame {
+    uint64_t start;
+    uint64_t child;              // ticks spent in probes opened inside this one
+    uint8_t tp;
+};
+
+// one per thread, written only by its owner
+struct trace_buf {
+    char name[16];
+    int depth;
+    uint64_t path;
+    struct trace_frame stack[TRACE_DEPTH];
+    struct trace_entry slots[TRACE_SLOTS];
+    uint64_t lost;               // ticks whose stack found no free slot
+    struct trace_buf *prev, *next;
+};
+
+// stacks of threads that are gone, merged by thread name
+struct trace_fold {
+    char name[16];
+    uint64_t path;
+    uint64_t calls;
+    uint64_t ticks;
+};
+
+struct fold_table {
+    struct trace_fold *rows;
+    size_t count, cap;
+};
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_buf *live = NULL;         // under trace_lock
+static struct fold_table retired = { NULL, 0, 0 };
+static pthread_key_t buf_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static __thread struct trace_buf *my_buf = NULL;
+
+static void fold_add(struct fold_table *t, const char *name, uint64_t path,
+                     uint64_t calls, uint64_t ticks) {
+    size_t i;
+    for (i = 0; i < t->count; i++) {
+        if (t->rows[i].path == path && strcmp(t->rows[i].name, name) == 0) {
+            t->rows[i].calls += calls;
+            t->rows[i].ticks += ticks;
+            return;
+        }
+    }
+    if (t->count == t->cap) {
+        size_t newcap = t->cap ? t->cap * 2 : 64;
+        struct trace_fold *rows = (struct trace_fold *) realloc(t->rows, newcap * sizeof(*rows));
+        if (!rows) {
+            return;
+        }
+        t->rows = rows;
+        t->cap = newcap;
+    }
+    struct trace_fold *row = &t->rows[t->count++];
+    snprintf(row->name, sizeof(row->name), "%s", name);
+    row->path = path;
+    row->calls = calls;
+    row->ticks = ticks;
+}
+
+// fold a thread's stacks into t; a path of 0 stands for the lost ticks
+static void fold_buf(struct fold_table *t, const struct trace_buf *b) {
+    int i;
+    for (i = 0; i < TRACE_SLOTS; i++) {
+        if (b->slots[i].path != 0) {
+            fold_add(t, b->name, b->slots[i].path, b->slots[i].calls, b->slots[i].ticks);
+        }
+    }
+    if (b->lost) {
+        fold_add(t, b->name, 0, 0, b->lost);
+    }
+}
+
+// a thread is exiting: keep its stacks and free the buffer
+static void retire_buf(void *arg) {
+    struct trace_buf *b = (struct trace_buf *) arg;
+
+    pthread_mutex_lock(&trace_lock);
+    fold_buf(&retired, b);
+    if (b->prev) b->prev->next = b->next; else live = b->next;
+    if (b->next) b->next->prev = b->prev;
+    pthread_mutex_unlock(&trace_lock);
+    free(b);
+}
+
+static void make_key(void) {
+    pthread_key_create(&buf_key, retire_buf);
+}
+
+static struct trace_buf *get_buf(void) {
+    if (my_buf) {
+        return my_buf;
+    }
+    struct trace_buf *b = (struct trace_buf *) calloc(1, sizeof(struct trace_buf));
+    if (!b) {
+        return NULL;
+    }
+    snprintf(b->name, sizeof(b->name), "thread");
+    pthread_once(&key_once, make_key);
+    pthread_setspecific(buf_key, b);
+
+    pthread_mutex_lock(&trace_lock);
+    b->next = live;
+    if (live) live->prev = b;
+    live = b;
+    pthread_mutex_unlock(&trace_lock);
+
+    my_buf = b;
+    return b;
+}
+
+void trace_thread(const char *name, int index) {
+    struct trace_buf *b = get_buf();
+    if (b && index >= 0) {
+        snprintf(b->name, sizeof(b->name), "%s-%d", name, index);
+    } else if (b) {
+        snprintf(b->name, sizeof(b->name), "%s", name);
+    }
+}
+
+void trace_begin(enum trace_point tp) {
+    struct trace_buf *b = get_buf();
+    if (!b || b->depth == TRACE_DEPTH) {
+        return;
+    }
+    struct trace_frame *f = &b->stack[b->depth++];
+    f->tp = (uint8_t) tp;
+    f->child = 0;
+    b->path = (b->path << 8) | f->tp;
+    f->start = now_ticks();
+}
+
+// charge a finished probe's self time to the stack it closes
+static void record(struct trace_buf *b, uint64_t ticks) {
+    uint32_t i = (uint32_t) ((b->path * 0x9e3779b97f4a7c15ull) >> 32) % TRACE_SLOTS;
+    int n;
+    for (n = 0; n < TRACE_SLOTS; n++, i = (i + 1) % TRACE_SLOTS) {
+        struct trace_entry *e = &b->slots[i];
+        if (e->path == b->path || e->path == 0) {
+            e->path = b->path;
+            e->calls++;
+            e->ticks += ticks;
+            return;
+        }
+    }
+    b->lost += ticks;
+}
+
+void trace_end(enum trace_point tp) {
+    uint64_t now = now_ticks();
+    struct trace_buf *b = my_buf;
+    int d;
+
+    if (!b) {
+        return;
+    }
+    for (d = b->depth - 1; d >= 0 && b->stack[d].tp != tp; d--) {
+    }
+    if (d < 0) {
+        return;   // opened past TRACE_DEPTH, or never opened
+    }
+
+    while (b->depth > d) {
+        struct trace_frame *f = &b->stack[b->depth - 1];
+        uint64_t elapsed = now - f->start;
+        record(b, elapsed > f->child ? elapsed - f->child : 0);
+        b->depth--;
+        b->path >>= 8;
+        if (b->depth > 0) {
+            b->stack[b->depth - 1].child += elapsed;
+        }
+    }
+}
+
+static void print_stack(FILE *out, const struct trace_fold *row) {
+    uint8_t tps[TRACE_DEPTH];
+    int n = 0;
+    uint64_t path = row->path;
+
+    fputs(row->name, out);
+    if (path == 0) {
+        fputs(";[lost]", out);
+    }
+    while (path != 0 && n < TRACE_DEPTH) {
+        tps[n++] = (uint8_t) (path & 0xff);
+        path >>= 8;
+    }
+    while (n > 0) {
+        uint8_t tp = tps[--n];
+        fprintf(out, ";%s", tp < TP_COUNT ? probe_names[tp] : "?");
+    }
+    fprintf(out, " %llu\n", (unsigned long long) row->ticks);
+}
+
+void trace_dump(const char *path) {
+    struct fold_table all = { NULL, 0, 0 };
+    struct trace_buf *b;
+    size_t i;
+
+    if (!path) {
+        path = getenv("TRACE_FILE");
+    }
+    if (!path) {
+        path = "trace.folded";
+    }
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        perror("fopen");
+        return;
+    }
+
+    // live threads keep running; their counters may be a probe behind
+    pthread_mutex_lock(&trace_lock);
+    for (i = 0; i < retired.count; i++) {
+        fold_add(&all, retired.rows[i].name, retired.rows[i].path,
+                 retired.rows[i].calls, retired.rows[i].ticks);
+    }
+    for (b = live; b != NULL; b = b->next) {
+        fold_buf(&all, b);
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    for (i = 0; i < all.count; i++) {
+        print_stack(out, &all.rows[i]);
+    }
+    fclose(out);
+
+    // and a summary per probe, by the probe that closed each stack
+    uint64_t calls[TP_COUNT] = { 0 }, ticks[TP_COUNT] = { 0 };
+    for (i = 0; i < all.count; i++) {
+        uint8_t tp = (uint8_t) (all.rows[i].path & 0xff);
+        if (all.rows[i].path != 0 && tp < TP_COUNT) {
+            calls[tp] += all.rows[i].calls;
+            ticks[tp] += all.rows[i].ticks;
+        }
+    }
+    printf("trace: %zu stacks in %s, self time in %s\n", all.count, path, TRACE_UNIT);
+    for (i = 1; i < TP_COUNT; i++) {
+        if (calls[i]) {
+            printf("  %-18s %12llu calls %16llu self %10llu avg\n", probe_names[i],
+                   (unsigned long long) calls[i], (unsigned long long) ticks[i],
+                   (unsigned long long) (ticks[i] / calls[i]));
+        }
+    }
+    free(all.rows);
+}
+
+#endif
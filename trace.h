@@ -0,0 +1,56 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// timing probes around locks and hot paths, compiled in with -DTRACE
+// (make trace) and compiled out otherwise. Each thread keeps its own
+// table of probe stacks with call counts and self time, dumped at exit
+// in folded form for flamegraph.pl
+
+enum trace_point {
+    TP_NONE,
+    TP_READ_WAIT,                // start_read() until the lock is held
+    TP_READ_HOLD,                // start_read() to end_read()
+    TP_WRITE_WAIT,
+    TP_WRITE_HOLD,
+    TP_RECIPIENTS,               // build_recipients()
+    TP_FANOUT,                   // a send loop over recipients
+    TP_CMD_CREATE,
+    TP_CMD_JOIN,
+    TP_CMD_LEAVE,
+    TP_CMD_CONNECT,
+    TP_CMD_DISCONNECT,
+    TP_CMD_LIST,
+    TP_CMD_LOGIN,
+    TP_CMD_MESSAGE,
+    TP_CMD_RELAY,                // one piece of a large message
+    TP_CLEANUP,                  // a client leaving
+    TP_COUNT
+};
+
+#ifdef TRACE
+
+// name the calling thread's stacks; index >= 0 is appended, as in "worker-1"
+void trace_thread(const char *name, int index);
+
+// open and close a probe; closing pops every probe opened after it
+void trace_begin(enum trace_point tp);
+void trace_end(enum trace_point tp);
+
+// write every thread's stacks to path, or $TRACE_FILE, or trace.folded
+void trace_dump(const char *path);
+
+#define TRACE_THREAD(name, index) trace_thread(name, index)
+#define TRACE_BEGIN(tp)    trace_begin(tp)
+#define TRACE_END(tp)      trace_end(tp)
+#define TRACE_DUMP()       trace_dump(NULL)
+
+#else
+
+#define TRACE_THREAD(name, index) ((void) 0)
+#define TRACE_BEGIN(tp)    ((void) 0)
+#define TRACE_END(tp)      ((void) 0)
+#define TRACE_DUMP()       ((void) 0)
+
+#endif
+
+#endif
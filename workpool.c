@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "workpool.h"
+#include "trace.h"
+#include "placement.h"
+
+#define DEQUE_INITIAL 64
+
+// per-worker double ended queue: the owner pushes and pops at the bottom,
+// thieves take from the top
+struct work_deque {
+    pthread_mutex_t lock;
+    struct work_item *items;     // ring buffer
+    int cap;                     // power of two
+    int top;                     // index of oldest item
+    int count;
+};
+
+static struct work_deque *deques = NULL;
+static int num_workers = 0;
+static atomic_uint next_deque = 0;      // round-robin cursor for outside submits
+
+// sleeping workers wait here until work is submitted
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static atomic_int pending = 0;          // items queued and not yet taken
+
+static __thread int my_worker = -1;     // index of the calling worker thread
+
+static int deque_push_bottom(struct work_deque *d, struct work_item item) {
+    pthread_mutex_lock(&d->lock);
+    if (d->count == d->cap) {
+        int newcap = d->cap * 2;
+        struct work_item *grown = (struct work_item *) malloc(newcap * sizeof(struct work_item));
+        if (!grown) {
+            pthread_mutex_unlock(&d->lock);
+            perror("malloc");
+            return -1;
+        }
+        int i;
+        for (i = 0; i < d->count; i++) {
+            grown[i] = d->items[(d->top + i) & (d->cap - 1)];
+        }
+        free(d->items);
+        d->items = grown;
+        d->cap = newcap;
+        d->top = 0;
+    }
+    d->items[(d->top + d->count) & (d->cap - 1)] = item;
+    d->count++;
+    pthread_mutex_unlock(&d->lock);
+    return 0;
+}
+
+// owner side: newest first, it is most likely still in cache
+static int deque_pop_bottom(struct work_deque *d, struct work_item *out) {
+    int ok = 0;
+    pthread_mutex_lock(&d->lock);
+    if (d->count > 0) {
+        d->count--;
+        *out = d->items[(d->top + d->count) & (d->cap - 1)];
+        ok = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return ok;
+}
+
+// thief side: oldest first
+static int deque_steal_top(struct work_deque *d, struct work_item *out) {
+    int ok = 0;
+    if (pthread_mutex_trylock(&d->lock) != 0) {
+        return 0;   // contended, try another victim
+    }
+    if (d->count > 0) {
+        *out = d->items[d->top];
+        d->top = (d->top + 1) & (d->cap - 1);
+        d->count--;
+        ok = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return ok;
+}
+
+static int find_work(int self, struct work_item *out) {
+    int i;
+
+    if (deque_pop_bottom(&deques[self], out)) {
+        return 1;
+    }
+    for (i = 1; i < num_workers; i++) {
+        if (deque_steal_top(&deques[(self + i) % num_workers], out)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void *worker_main(void *arg) {
+    my_worker = (int)(long) arg;
+    TRACE_THREAD("worker", my_worker);
+    place_thread(PLACE_WORKER, my_worker);
+
+    while (1) {
+        struct work_item item;
+        if (find_work(my_worker, &item)) {
+            atomic_fetch_sub(&pending, 1);
+            item.fn(item.arg);
+            continue;
+        }
+
+        pthread_mutex_lock(&idle_lock);
+        while (atomic_load(&pending) == 0) {
+            pthread_cond_wait(&idle_cond, &idle_lock);
+        }
+        pthread_mutex_unlock(&idle_lock);
+    }
+    return NULL;
+}
+
+int workpool_start(int nworkers) {
+    int i;
+
+    if (nworkers <= 0) {
+        return 0;   // pool disabled, work runs inline
+    }
+
+    deques = (struct work_deque *) calloc(nworkers, sizeof(struct work_deque));
+    if (!deques) {
+        perror("calloc");
+        return -1;
+    }
+    for (i = 0; i < nworkers; i++) {
+        pthread_mutex_init(&deques[i].lock, NULL);
+        deques[i].cap = DEQUE_INITIAL;
+        deques[i].items = (struct work_item *) malloc(DEQUE_INITIAL * sizeof(struct work_item));
+        if (!deques[i].items) {
+            perror("malloc");
+            return -1;
+        }
+    }
+
+    num_workers = nworkers;
+    for (i = 0; i < nworkers; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, worker_main, (void *)(long) i) != 0) {
+            perror("pthread_create");
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+    return 0;
+}
+
+int workpool_running(void) {
+    return num_workers > 0;
+}
+
+int workpool_submit(void (*fn)(void *arg), void *arg) {
+    struct work_item item = { fn, arg };
+    int target;
+
+    if (num_workers == 0) {
+        return -1;
+    }
+
+    if (my_worker >= 0) {
+        target = my_worker;
+    } else {
+        target = atomic_fetch_add(&next_deque, 1) % num_workers;
+    }
+    if (deque_push_bottom(&deques[target], item) != 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&idle_lock);
+    atomic_fetch_add(&pending, 1);
+    pthread_cond_signal(&idle_cond);
+    pthread_mutex_unlock(&idle_lock);
+    return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+// a unit of work run on one of the pool's threads
+struct work_item {
+    void (*fn)(void *arg);
+    void *arg;
+};
+
+// start a fixed pool of worker threads, each with its own deque
+// return 0 on success, -1 if the pool could not be started
+int workpool_start(int nworkers);
+
+// return 1 if the pool is running
+int workpool_running(void);
+
+// queue work; from a worker it goes on that worker's own deque, otherwise
+// it is spread round-robin. Idle workers steal from the other end of busy
+// workers' deques. Return -1 if the pool is not running or out of memory,
+// in which case the caller should run the work itself
+int workpool_submit(void (*fn)(void *arg), void *arg);
+
+#endif